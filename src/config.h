@@ -25,9 +25,53 @@
 #define BBQX0KBD_NO_INT				1
 #define BBQX0KBD_INT BBQX0KBD_USE_INT
 
-#if (BBQX0KBD_INT == BBQX0KBD_NO_INT)
+// Poll period in milliseconds while keys are active, and the
+// idle period that polling backs off to
+#define BBQX0KBD_POLL_MIN_PERIOD 4
 #define BBQX0KBD_POLL_PERIOD 40
-#else
+
+// In hybrid mode, milliseconds without events before returning to interrupts
+#define BBQX0KBD_HYBRID_QUIET_PERIOD 50
+
+// Maximum spacing in microseconds between timestamps of key events
+// that arrived in the same FIFO batch
+#define BBQX0KBD_BATCH_SPREAD_US 2000
+
+// Seconds between reading the firmware RTC to correct the anchored time
+#define BBQX0KBD_RTC_RESYNC_PERIOD 600
+
+// Maximum RTC reads to get a reading without a rollover
+#define BBQX0KBD_RTC_READ_ATTEMPTS 3
+
+// Maximum FIFO reads to drain firmware events after an overflow
+#define BBQX0KBD_OVERFLOW_DRAIN_READS 4
+
+// Milliseconds between battery level samples, and number of recent
+// samples filtered into the reported level
+#define BBQX0KBD_BATTERY_PERIOD 10000
+#define BBQX0KBD_BATTERY_SAMPLES 8
+
+// Milliseconds without a keypress before notifying idle
+#define BBQX0KBD_IDLE_PERIOD 30000
+
+// Backlight fades in this many steps, this many milliseconds apart
+#define BBQX0KBD_FADE_STEPS 8
+#define BBQX0KBD_FADE_STEP_MS 40
+
+// Minimum milliseconds between change notifications of a sysfs entry
+#define BBQX0KBD_NOTIFY_PERIOD 1000
+
+// Battery percentage change that notifies battery_percent pollers
+#define BBQX0KBD_BATTERY_NOTIFY_BAND 5
+
+// Format version of the telemetry sysfs entry, increased when
+// existing lines change meaning. New lines may be added at any time
+#define BBQX0KBD_TELEMETRY_VERSION 1
+
+// Milliseconds after touch input turns off before lowering touchpad LED power
+#define BBQX0KBD_TOUCH_GATE_DELAY 2000
+
+#if (BBQX0KBD_INT == BBQX0KBD_USE_INT)
 #define BBQX0KBD_INT_PIN 4
 #endif
 
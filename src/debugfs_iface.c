@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Debugfs interface at /sys/kernel/debug/beepy-kbd
+
+#include <linux/types.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+
+#include "config.h"
+
+#include "input_iface.h"
+#include "debugfs_iface.h"
+
+static struct dentry *g_debugfs_dir = NULL;
+
+// Key event ring occupancy and loss counters
+static int key_ring_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+
+	seq_printf(s, "size: %u\n", kfifo_size(&ctx->key_ring));
+	seq_printf(s, "len: %u\n", kfifo_len(&ctx->key_ring));
+	seq_printf(s, "high_water: %u\n", ctx->key_ring_high_water);
+	seq_printf(s, "dropped: %u\n", ctx->key_ring_dropped);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(key_ring);
+
+// IRQ-to-input_sync latency for each reporting path
+static int report_latency_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+	static char const* path_names[NUM_REPORT_PATHS] = {
+		[REPORT_PATH_WORKER] = "worker",
+		[REPORT_PATH_IRQ] = "irq",
+		[REPORT_PATH_POLL] = "poll",
+	};
+	struct report_latency latency;
+	int i;
+
+	seq_printf(s, "%-10s %10s %10s %10s %10s\n",
+		"path", "count", "min_us", "avg_us", "max_us");
+
+	for (i = 0; i < NUM_REPORT_PATHS; i++) {
+
+		// Take a consistent copy of the counters
+		mutex_lock(&ctx->report_lock);
+		latency = ctx->report_latency[i];
+		mutex_unlock(&ctx->report_lock);
+
+		seq_printf(s, "%-10s %10llu %10llu %10llu %10llu\n",
+			path_names[i], latency.count,
+			div_u64(latency.min_ns, NSEC_PER_USEC),
+			(latency.count)
+				? div64_u64(latency.total_ns, latency.count * NSEC_PER_USEC)
+				: 0,
+			div_u64(latency.max_ns, NSEC_PER_USEC));
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(report_latency);
+
+// Current input mode and poll period
+static int input_mode_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+
+	static char const* mode_names[] = {
+		[INPUT_MODE_IRQ] = "irq",
+		[INPUT_MODE_POLL] = "poll",
+		[INPUT_MODE_HYBRID] = "hybrid",
+	};
+
+	seq_printf(s, "mode: %s\n", mode_names[ctx->input_mode]);
+	seq_printf(s, "irq: %d (%s)\n", ctx->irq,
+		(ctx->irq_enabled) ? "enabled" : "disabled");
+	seq_printf(s, "poll_period_ms: %u\n", ctx->poll_period_ms);
+
+	// Hybrid mode interrupt mitigation
+	seq_printf(s, "hybrid_polling: %u\n", ctx->hybrid_polling);
+	seq_printf(s, "hybrid_quiet_ms: %u\n", ctx->hybrid_quiet_ms);
+	seq_printf(s, "hybrid_entries: %u\n", ctx->hybrid_entries);
+	seq_printf(s, "hybrid_polls: %u\n", ctx->hybrid_polls);
+	seq_printf(s, "hybrid_irqs_saved: %u\n", ctx->hybrid_irqs_saved);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(input_mode);
+
+// Input worker scheduling and time from queueing to running
+static int worker_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+	static char const* sched_names[] = {
+		[WORKER_SCHED_NORMAL] = "normal",
+		[WORKER_SCHED_FIFO_LOW] = "fifo_low",
+		[WORKER_SCHED_FIFO] = "fifo",
+	};
+	struct report_latency delay;
+
+	// Take a consistent copy of the counters
+	mutex_lock(&ctx->report_lock);
+	delay = ctx->worker_queue_delay;
+	mutex_unlock(&ctx->report_lock);
+
+	seq_printf(s, "pid: %d\n", task_pid_nr(ctx->worker->task));
+	seq_printf(s, "sched: %s\n", sched_names[ctx->worker_sched]);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0))
+	seq_printf(s, "cpus: %*pbl\n",
+		cpumask_pr_args(ctx->worker->task->cpus_ptr));
+#else
+	seq_printf(s, "cpus: %*pbl\n",
+		cpumask_pr_args(&ctx->worker->task->cpus_allowed));
+#endif
+	seq_printf(s, "queue_count: %llu\n", delay.count);
+	seq_printf(s, "queue_min_us: %llu\n", div_u64(delay.min_ns, NSEC_PER_USEC));
+	seq_printf(s, "queue_avg_us: %llu\n", (delay.count)
+		? div64_u64(delay.total_ns, delay.count * NSEC_PER_USEC)
+		: 0);
+	seq_printf(s, "queue_max_us: %llu\n", div_u64(delay.max_ns, NSEC_PER_USEC));
+
+	return 0;
+}
+
+// Write anything to reset queueing delay statistics
+static ssize_t worker_write(struct file *file, char const __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct kbd_ctx *ctx = file_inode(file)->i_private;
+
+	mutex_lock(&ctx->report_lock);
+	memset(&ctx->worker_queue_delay, 0, sizeof(ctx->worker_queue_delay));
+	mutex_unlock(&ctx->report_lock);
+
+	return count;
+}
+
+static int worker_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, worker_show, inode->i_private);
+}
+
+static const struct file_operations worker_fops = {
+	.owner = THIS_MODULE,
+	.open = worker_open,
+	.read = seq_read,
+	.write = worker_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// Interrupt, FIFO, key, touch, and I2C error counters
+static int stats_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+	static char const* consumer_names[NUM_KEY_CONSUMERS] = {
+		[KEY_CONSUMER_NONE] = "none",
+		[KEY_CONSUMER_POWER] = "power",
+		[KEY_CONSUMER_FW] = "fw",
+		[KEY_CONSUMER_TOUCH] = "touch",
+		[KEY_CONSUMER_MODIFIERS] = "modifiers",
+		[KEY_CONSUMER_META] = "meta",
+		[KEY_CONSUMER_PASSTHROUGH] = "passthrough",
+	};
+	long read_errors, write_errors;
+	int i;
+
+	seq_printf(s, "irqs: %ld\n", atomic_long_read(&ctx->stats.irqs));
+	seq_printf(s, "irqs_none: %ld\n", atomic_long_read(&ctx->stats.irqs_none));
+	seq_printf(s, "overflows: %ld\n", atomic_long_read(&ctx->stats.overflows));
+	seq_printf(s, "overflow_recoveries: %ld\n",
+		atomic_long_read(&ctx->stats.overflow_recoveries));
+	seq_printf(s, "synthesized_releases: %ld\n",
+		atomic_long_read(&ctx->stats.synthesized_releases));
+	seq_printf(s, "touch_events: %ld\n",
+		atomic_long_read(&ctx->stats.touch_events));
+
+	// Keys handled by each subsystem
+	for (i = 0; i < NUM_KEY_CONSUMERS; i++) {
+		seq_printf(s, "keys_%s: %ld\n", consumer_names[i],
+			atomic_long_read(&ctx->stats.keys[i]));
+	}
+
+	// Number of items in firmware FIFO on each read with key events
+	seq_puts(s, "fifo_depth:\n");
+	for (i = 0; i <= BBQX0KBD_FIFO_SIZE; i++) {
+		if (atomic_long_read(&ctx->stats.fifo_depth[i])) {
+			seq_printf(s, "  %2d: %ld\n", i,
+				atomic_long_read(&ctx->stats.fifo_depth[i]));
+		}
+	}
+
+	// Only registers with errors are listed
+	seq_puts(s, "i2c_errors:\n");
+	for (i = 0; i < NUM_REGS; i++) {
+		read_errors = atomic_long_read(&ctx->stats.i2c_read_errors[i]);
+		write_errors = atomic_long_read(&ctx->stats.i2c_write_errors[i]);
+		if (read_errors || write_errors) {
+			seq_printf(s, "  0x%02x: read %ld write %ld\n",
+				i, read_errors, write_errors);
+		}
+	}
+
+	return 0;
+}
+
+// Write anything to reset statistics
+static ssize_t stats_write(struct file *file, char const __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct kbd_ctx *ctx = file_inode(file)->i_private;
+	size_t i;
+
+	atomic_long_set(&ctx->stats.irqs, 0);
+	atomic_long_set(&ctx->stats.irqs_none, 0);
+	atomic_long_set(&ctx->stats.overflows, 0);
+	atomic_long_set(&ctx->stats.overflow_recoveries, 0);
+	atomic_long_set(&ctx->stats.synthesized_releases, 0);
+	atomic_long_set(&ctx->stats.touch_events, 0);
+	for (i = 0; i < ARRAY_SIZE(ctx->stats.fifo_depth); i++) {
+		atomic_long_set(&ctx->stats.fifo_depth[i], 0);
+	}
+	for (i = 0; i < ARRAY_SIZE(ctx->stats.keys); i++) {
+		atomic_long_set(&ctx->stats.keys[i], 0);
+	}
+	for (i = 0; i < NUM_REGS; i++) {
+		atomic_long_set(&ctx->stats.i2c_read_errors[i], 0);
+		atomic_long_set(&ctx->stats.i2c_write_errors[i], 0);
+	}
+
+	return count;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// Shadowed indirect touchpad register values
+// Direct registers are listed by regmap debugfs
+static int registers_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+	int i;
+
+	mutex_lock(&ctx->shadow.lock);
+
+	seq_printf(s, "resyncs: %u\n", ctx->shadow.resyncs);
+
+	for_each_set_bit(i, ctx->shadow.touchpad_valid, NUM_TOUCHPAD_REGS) {
+		seq_printf(s, "touchpad 0x%02x: 0x%02x\n", i,
+			ctx->shadow.touchpad_value[i]);
+	}
+
+	mutex_unlock(&ctx->shadow.lock);
+
+	return 0;
+}
+
+// Write anything to rewrite cached registers to firmware
+static ssize_t registers_write(struct file *file, char const __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct kbd_ctx *ctx = file_inode(file)->i_private;
+	int rc;
+
+	if ((rc = input_fw_resync(ctx))) {
+		return rc;
+	}
+
+	return count;
+}
+
+static int registers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, registers_show, inode->i_private);
+}
+
+static const struct file_operations registers_fops = {
+	.owner = THIS_MODULE,
+	.open = registers_open,
+	.read = seq_read,
+	.write = registers_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// RTC anchor and drift statistics
+static int rtc_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+
+	mutex_lock(&ctx->rtc.lock);
+
+	seq_printf(s, "anchored: %d\n", ctx->rtc.valid);
+	if (ctx->rtc.valid) {
+		seq_printf(s, "anchor_age_s: %llu\n",
+			div_u64(ktime_get_boottime_ns() - ctx->rtc.boottime_ns,
+				NSEC_PER_SEC));
+	}
+	seq_printf(s, "reads: %u\n", ctx->rtc.reads);
+	seq_printf(s, "resyncs: %u\n", ctx->rtc.resyncs);
+	seq_printf(s, "last_drift_s: %lld\n", ctx->rtc.last_drift_secs);
+	seq_printf(s, "max_drift_s: %lld\n", ctx->rtc.max_drift_secs);
+
+	mutex_unlock(&ctx->rtc.lock);
+
+	return 0;
+}
+
+// Write anything to read firmware RTC and update anchor
+static ssize_t rtc_write(struct file *file, char const __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct kbd_ctx *ctx = file_inode(file)->i_private;
+	int rc;
+
+	if ((rc = input_rtc_resync(ctx))) {
+		return rc;
+	}
+
+	return count;
+}
+
+static int rtc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rtc_show, inode->i_private);
+}
+
+static const struct file_operations rtc_fops = {
+	.owner = THIS_MODULE,
+	.open = rtc_open,
+	.read = seq_read,
+	.write = rtc_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// Touchpad LED power gating while touch input is off
+static int touch_power_show(struct seq_file *s, void *data)
+{
+	struct kbd_ctx *ctx = s->private;
+	struct touch_power power;
+
+	input_touch_get_power(ctx, &power);
+
+	seq_printf(s, "gated: %d\n", power.gated);
+	seq_printf(s, "gates: %u\n", power.gates);
+	seq_printf(s, "ungates: %u\n", power.ungates);
+	seq_printf(s, "active_ms: %llu\n", div_u64(power.active_ns, NSEC_PER_MSEC));
+	seq_printf(s, "gated_ms: %llu\n", div_u64(power.gated_ns, NSEC_PER_MSEC));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(touch_power);
+
+int debugfs_probe(struct i2c_client* i2c_client)
+{
+	// Debugfs is optional, failures are not fatal
+	g_debugfs_dir = debugfs_create_dir("beepy-kbd", NULL);
+
+	debugfs_create_file("key_ring", 0444, g_debugfs_dir, g_ctx,
+		&key_ring_fops);
+	debugfs_create_file("report_latency", 0444, g_debugfs_dir, g_ctx,
+		&report_latency_fops);
+	debugfs_create_file("input_mode", 0444, g_debugfs_dir, g_ctx,
+		&input_mode_fops);
+	debugfs_create_file("worker", 0644, g_debugfs_dir, g_ctx,
+		&worker_fops);
+	debugfs_create_file("stats", 0644, g_debugfs_dir, g_ctx,
+		&stats_fops);
+	debugfs_create_file("registers", 0644, g_debugfs_dir, g_ctx,
+		&registers_fops);
+	debugfs_create_file("rtc", 0644, g_debugfs_dir, g_ctx,
+		&rtc_fops);
+	debugfs_create_file("touch_power", 0444, g_debugfs_dir, g_ctx,
+		&touch_power_fops);
+
+	return 0;
+}
+
+void debugfs_shutdown(struct i2c_client* i2c_client)
+{
+	// Remove debugfs entries
+	debugfs_remove_recursive(g_debugfs_dir);
+	g_debugfs_dir = NULL;
+}
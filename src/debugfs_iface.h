@@ -0,0 +1,12 @@
+#ifndef DEBUGFS_IFACE_H_
+#define DEBUGFS_IFACE_H_
+
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Keyboard Driver for Blackberry Keyboards BBQ10 from arturo182. Software written by wallComputer.
+ */
+
+int debugfs_probe(struct i2c_client* i2c_client);
+void debugfs_shutdown(struct i2c_client* i2c_client);
+
+#endif
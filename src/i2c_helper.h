@@ -4,10 +4,12 @@
 #define I2C_HELPER_H_
 
 #include <linux/i2c.h>
+#include <linux/regmap.h>
 
 #include "config.h"
 #include "registers.h"
 #include "debug_levels.h"
+#include "input_iface.h"
 
 // Parse 0 to 255 from string
 static inline int parse_u8(char const* buf)
@@ -21,18 +23,57 @@ static inline int parse_u8(char const* buf)
 	return result;
 }
 
-// Read a single uint8_t value from I2C register
+// Count failed transfer in keyboard context statistics
+static inline void kbd_count_i2c_error(struct i2c_client* i2c_client,
+	uint8_t reg_addr, int write)
+{
+	struct kbd_ctx *ctx;
+
+	if ((ctx = i2c_get_clientdata(i2c_client)) == NULL) {
+		return;
+	}
+
+	reg_addr &= ~BBQX0KBD_WRITE_MASK;
+	atomic_long_inc((write)
+		? &ctx->stats.i2c_write_errors[reg_addr]
+		: &ctx->stats.i2c_read_errors[reg_addr]);
+
+	// Check whether firmware reset after the next successful read
+	atomic_set(&ctx->shadow.check_reset, 1);
+}
+
+// Get register map for client
+static inline struct regmap* kbd_get_regmap(struct i2c_client* i2c_client)
+{
+	struct kbd_ctx *ctx;
+
+	if ((ctx = i2c_get_clientdata(i2c_client)) == NULL) {
+		return NULL;
+	}
+
+	return ctx->regmap;
+}
+
+// Read a single uint8_t value from register
+// Configuration registers are served from the register cache
 static inline int kbd_read_i2c_u8(struct i2c_client* i2c_client, uint8_t reg_addr,
 	uint8_t* dst)
 {
-	int reg_value;
+	int rc;
+	unsigned int reg_value;
+	struct regmap *regmap;
+
+	if ((regmap = kbd_get_regmap(i2c_client)) == NULL) {
+		return -ENODEV;
+	}
 
-	// Read value over I2C
-	if ((reg_value = i2c_smbus_read_byte_data(i2c_client, reg_addr)) < 0) {
+	// Read value from cache or over I2C
+	if ((rc = regmap_read(regmap, reg_addr, &reg_value))) {
 		dev_err(&i2c_client->dev,
 			"%s Could not read from register 0x%02X, error: %d\n",
-			__func__, reg_addr, reg_value);
-		return reg_value;
+			__func__, reg_addr, rc);
+		kbd_count_i2c_error(i2c_client, reg_addr, 0);
+		return rc;
 	}
 
 	// Assign result to buffer
@@ -41,44 +82,85 @@ static inline int kbd_read_i2c_u8(struct i2c_client* i2c_client, uint8_t reg_add
 	return 0;
 }
 
-// Write a single uint8_t value to I2C register
+// Write a single uint8_t value to register
 static inline int kbd_write_i2c_u8(struct i2c_client* i2c_client, uint8_t reg_addr,
 	uint8_t src)
 {
 	int rc;
+	struct regmap *regmap;
 
-	// Write value over I2C
-	if ((rc = i2c_smbus_write_byte_data(i2c_client,
-		reg_addr | BBQX0KBD_WRITE_MASK, src))) {
+	if ((regmap = kbd_get_regmap(i2c_client)) == NULL) {
+		return -ENODEV;
+	}
 
+	// Write value over I2C, register map sets write flag
+	if ((rc = regmap_write(regmap, reg_addr, src))) {
 		dev_err(&i2c_client->dev,
 			"%s Could not write to register 0x%02X, Error: %d\n",
 			__func__, reg_addr, rc);
+		kbd_count_i2c_error(i2c_client, reg_addr, 1);
+
+		// Client value is unknown after failed write
+		(void)regcache_drop_region(regmap, reg_addr, reg_addr);
 		return rc;
 	}
 
 	return 0;
 }
 
-// Read a pair of uint8_t values from I2C register
-static inline int kbd_read_i2c_2u8(struct i2c_client* i2c_client, uint8_t reg_addr,
-	uint8_t* dst)
+// Update bits in mask of a register
+// Cached registers are not read, and unchanged values are not written
+static inline int kbd_update_i2c_u8(struct i2c_client* i2c_client, uint8_t reg_addr,
+	uint8_t mask, uint8_t bits)
 {
-	int word_value;
+	int rc;
+	struct regmap *regmap;
 
-	// Read value over I2C
-	if ((word_value = i2c_smbus_read_word_data(i2c_client, reg_addr)) < 0) {
+	if ((regmap = kbd_get_regmap(i2c_client)) == NULL) {
+		return -ENODEV;
+	}
+
+	if ((rc = regmap_update_bits(regmap, reg_addr, mask, bits))) {
 		dev_err(&i2c_client->dev,
-			"%s Could not read from register 0x%02X, error: %d\n",
-			__func__, reg_addr, word_value);
-		return word_value;
+			"%s Could not update register 0x%02X, Error: %d\n",
+			__func__, reg_addr, rc);
+		kbd_count_i2c_error(i2c_client, reg_addr, 1);
+		(void)regcache_drop_region(regmap, reg_addr, reg_addr);
+		return rc;
 	}
 
-	// Assign result to buffer
-	*dst = (uint8_t)(word_value & 0xFF);
-	*(dst + 1) = (uint8_t)((word_value & 0xFF00) >> 8);
+	return 0;
+}
+
+// Read a block of uint8_t values from a single register,
+// such as the key FIFO or the battery ADC
+static inline int kbd_read_i2c_block(struct i2c_client* i2c_client, uint8_t reg_addr,
+	uint8_t* dst, uint16_t len)
+{
+	int rc;
+	struct regmap *regmap;
+
+	if ((regmap = kbd_get_regmap(i2c_client)) == NULL) {
+		return -ENODEV;
+	}
+
+	// Write register address, then read `len` bytes after repeated start
+	if ((rc = regmap_noinc_read(regmap, reg_addr, dst, len))) {
+		dev_err(&i2c_client->dev,
+			"%s Could not read %d bytes from register 0x%02X, error: %d\n",
+			__func__, len, reg_addr, rc);
+		kbd_count_i2c_error(i2c_client, reg_addr, 0);
+		return rc;
+	}
 
 	return 0;
 }
 
+// Read a pair of uint8_t values from a single register
+static inline int kbd_read_i2c_2u8(struct i2c_client* i2c_client, uint8_t reg_addr,
+	uint8_t* dst)
+{
+	return kbd_read_i2c_block(i2c_client, reg_addr, dst, 2);
+}
+
 #endif
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Register map description for keyboard firmware
+
+#include <linux/regmap.h>
+
+#include "config.h"
+#include "registers.h"
+#include "input_iface.h"
+#include "i2c_regmap.h"
+
+// Registers that can be read
+static const struct regmap_range readable_ranges[] = {
+	regmap_reg_range(REG_VER, REG_GIN),
+	regmap_reg_range(REG_CF2, REG_ADC),
+	regmap_reg_range(REG_LED, REG_STARTUP_REASON),
+	regmap_reg_range(REG_UPDATE_DATA, REG_UPDATE_DATA),
+	regmap_reg_range(REG_TOUCHPAD_REG, REG_TOUCHPAD_LED),
+};
+
+static const struct regmap_access_table readable_table = {
+	.yes_ranges = readable_ranges,
+	.n_yes_ranges = ARRAY_SIZE(readable_ranges),
+};
+
+// Registers that can be written
+static const struct regmap_range writable_ranges[] = {
+	regmap_reg_range(REG_CFG, REG_INT),
+	regmap_reg_range(REG_BKL, REG_RST),
+	regmap_reg_range(REG_BK2, REG_GIC),
+	regmap_reg_range(REG_CF2, REG_CF2),
+	regmap_reg_range(REG_LED, REG_DRIVER_STATE),
+	regmap_reg_range(REG_UPDATE_DATA, REG_UPDATE_DATA),
+	regmap_reg_range(REG_TOUCHPAD_REG, REG_TOUCHPAD_LED),
+};
+
+static const struct regmap_access_table writable_table = {
+	.yes_ranges = writable_ranges,
+	.n_yes_ranges = ARRAY_SIZE(writable_ranges),
+};
+
+// Configuration registers are only changed by the driver and can be cached.
+// All other registers are volatile and always read from the client.
+// Firmware changes REG_LED itself, such as when clearing flash-until-key mode
+static const struct regmap_range cached_ranges[] = {
+	regmap_reg_range(REG_CFG, REG_CFG),
+	regmap_reg_range(REG_BKL, REG_BKL),
+	regmap_reg_range(REG_CF2, REG_CF2),
+	regmap_reg_range(REG_LED_R, REG_LED_B),
+	regmap_reg_range(REG_TOUCHPAD_REG, REG_TOUCHPAD_REG),
+	regmap_reg_range(REG_TOUCHPAD_LED, REG_TOUCHPAD_LED),
+};
+
+static const struct regmap_range all_ranges[] = {
+	regmap_reg_range(0, REG_TOUCHPAD_LED),
+};
+
+static const struct regmap_access_table volatile_table = {
+	.yes_ranges = all_ranges,
+	.n_yes_ranges = ARRAY_SIZE(all_ranges),
+	.no_ranges = cached_ranges,
+	.n_no_ranges = ARRAY_SIZE(cached_ranges),
+};
+
+// Reading the FIFO pops it, touch movement is cleared on read
+static const struct regmap_range precious_ranges[] = {
+	regmap_reg_range(REG_FIF, REG_FIF),
+	regmap_reg_range(REG_TOX, REG_TOY),
+};
+
+static const struct regmap_access_table precious_table = {
+	.yes_ranges = precious_ranges,
+	.n_yes_ranges = ARRAY_SIZE(precious_ranges),
+};
+
+// FIFO and ADC return multiple bytes from a single register
+static const struct regmap_range noinc_ranges[] = {
+	regmap_reg_range(REG_FIF, REG_FIF),
+	regmap_reg_range(REG_ADC, REG_ADC),
+};
+
+static const struct regmap_access_table noinc_table = {
+	.yes_ranges = noinc_ranges,
+	.n_yes_ranges = ARRAY_SIZE(noinc_ranges),
+};
+
+static const struct regmap_config kbd_regmap_config = {
+	.name = "beepy-kbd",
+	.reg_bits = 8,
+	.val_bits = 8,
+
+	// Firmware sets top bit of register address for writes
+	.write_flag_mask = BBQX0KBD_WRITE_MASK,
+
+	.max_register = REG_TOUCHPAD_LED,
+	.rd_table = &readable_table,
+	.wr_table = &writable_table,
+	.volatile_table = &volatile_table,
+	.precious_table = &precious_table,
+	.rd_noinc_table = &noinc_table,
+
+	.cache_type = REGCACHE_RBTREE,
+};
+
+int kbd_regmap_init(struct i2c_client* i2c_client, struct kbd_ctx* ctx)
+{
+	ctx->regmap = devm_regmap_init_i2c(i2c_client, &kbd_regmap_config);
+	if (IS_ERR(ctx->regmap)) {
+		dev_err(&i2c_client->dev,
+			"%s Could not initialize register map: %ld\n",
+			__func__, PTR_ERR(ctx->regmap));
+		return PTR_ERR(ctx->regmap);
+	}
+
+	return 0;
+}
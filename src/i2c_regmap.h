@@ -0,0 +1,15 @@
+#ifndef I2C_REGMAP_H_
+#define I2C_REGMAP_H_
+
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Keyboard Driver for Blackberry Keyboards BBQ10 from arturo182. Software written by wallComputer.
+ */
+
+#include <linux/i2c.h>
+
+struct kbd_ctx;
+
+int kbd_regmap_init(struct i2c_client* i2c_client, struct kbd_ctx* ctx);
+
+#endif
@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Input battery subsystem
+
+#include <linux/power_supply.h>
+#include <linux/workqueue.h>
+
+#include "config.h"
+#include "i2c_helper.h"
+#include "input_iface.h"
+#include "sysfs_iface.h"
+
+// Globals
+
+static struct kbd_ctx* g_battery_ctx;
+static struct power_supply* g_battery_psy;
+
+static struct delayed_work g_battery_work;
+static unsigned int g_battery_period_ms;
+
+// Recent ADC samples and filtered reading, protected by battery lock
+static struct mutex g_battery_lock;
+static uint16_t g_samples[BBQX0KBD_BATTERY_SAMPLES];
+static unsigned int g_num_samples;
+static unsigned int g_next_sample;
+static struct battery_reading g_reading;
+static uint8_t g_reading_valid;
+
+// Single cell Li-ion open circuit voltage to remaining capacity,
+// in descending voltage order
+static struct power_supply_battery_ocv_table ocv_table[] = {
+	{ 4200000, 100 },
+	{ 4150000, 95 },
+	{ 4110000, 90 },
+	{ 4080000, 85 },
+	{ 4020000, 80 },
+	{ 3980000, 75 },
+	{ 3950000, 70 },
+	{ 3910000, 65 },
+	{ 3870000, 60 },
+	{ 3850000, 55 },
+	{ 3840000, 50 },
+	{ 3820000, 45 },
+	{ 3800000, 40 },
+	{ 3790000, 35 },
+	{ 3770000, 30 },
+	{ 3750000, 25 },
+	{ 3730000, 20 },
+	{ 3710000, 15 },
+	{ 3690000, 10 },
+	{ 3610000, 5 },
+	{ 3200000, 0 },
+};
+
+// Helpers
+
+// Mean of recent samples, discarding the highest and lowest
+// Called with battery lock held
+static int filtered_raw(void)
+{
+	unsigned int i;
+	int sum, lowest, highest;
+
+	sum = 0;
+	lowest = INT_MAX;
+	highest = 0;
+	for (i = 0; i < g_num_samples; i++) {
+		sum += g_samples[i];
+		lowest = min_t(int, lowest, g_samples[i]);
+		highest = max_t(int, highest, g_samples[i]);
+	}
+
+	if (g_num_samples < 3) {
+		return sum / g_num_samples;
+	}
+
+	return (sum - lowest - highest) / (g_num_samples - 2);
+}
+
+// Read ADC and update filtered reading
+// Returns 1 if capacity changed
+static int sample_battery(struct kbd_ctx* ctx)
+{
+	int rc, capacity_changed, band_changed;
+	uint8_t adc[2];
+
+	// Read battery level
+	if ((rc = kbd_read_i2c_2u8(ctx->i2c_client, REG_ADC, adc))) {
+		return rc;
+	}
+
+	mutex_lock(&g_battery_lock);
+
+	// Add to sample ring
+	g_samples[g_next_sample] = (adc[1] << 8) | adc[0];
+	g_next_sample = (g_next_sample + 1) % BBQX0KBD_BATTERY_SAMPLES;
+	if (g_num_samples < BBQX0KBD_BATTERY_SAMPLES) {
+		g_num_samples++;
+	}
+
+	// Calculate voltage in millivolts from filtered level
+	g_reading.raw = filtered_raw();
+	g_reading.voltage_mv = (g_reading.raw * 330 * 21) / 4095;
+
+	// Look up remaining capacity
+	capacity_changed = !g_reading_valid;
+	rc = power_supply_ocv2cap_simple(ocv_table, ARRAY_SIZE(ocv_table),
+		g_reading.voltage_mv * 1000);
+	if (rc != g_reading.capacity) {
+		capacity_changed = 1;
+	}
+	band_changed = g_reading_valid
+		&& ((rc / BBQX0KBD_BATTERY_NOTIFY_BAND)
+			!= (g_reading.capacity / BBQX0KBD_BATTERY_NOTIFY_BAND));
+	g_reading.capacity = rc;
+	g_reading_valid = 1;
+
+	mutex_unlock(&g_battery_lock);
+
+	// Wake battery_percent pollers
+	if (band_changed) {
+		sysfs_notify_battery();
+	}
+
+	return capacity_changed;
+}
+
+static void battery_work_handler(struct work_struct* work)
+{
+	int rc;
+	struct kbd_ctx* ctx;
+
+	// Sampling stopped
+	if ((ctx = g_battery_ctx) == NULL) {
+		return;
+	}
+
+	// Notify power supply listeners such as upower
+	if (((rc = sample_battery(ctx)) > 0) && g_battery_psy) {
+		power_supply_changed(g_battery_psy);
+	}
+
+	queue_delayed_work(system_power_efficient_wq, &g_battery_work,
+		msecs_to_jiffies(g_battery_period_ms));
+}
+
+// Power supply
+
+static enum power_supply_property battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_TECHNOLOGY,
+	POWER_SUPPLY_PROP_SCOPE,
+	POWER_SUPPLY_PROP_VOLTAGE_NOW,
+	POWER_SUPPLY_PROP_VOLTAGE_MAX_DESIGN,
+	POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN,
+	POWER_SUPPLY_PROP_CAPACITY,
+};
+
+static int battery_get_property(struct power_supply* psy,
+	enum power_supply_property psp, union power_supply_propval* val)
+{
+	int rc;
+	struct battery_reading reading;
+
+	switch (psp) {
+
+	// Firmware does not report charger state
+	case POWER_SUPPLY_PROP_STATUS:
+		val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
+		return 0;
+
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = 1;
+		return 0;
+
+	case POWER_SUPPLY_PROP_TECHNOLOGY:
+		val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+		return 0;
+
+	case POWER_SUPPLY_PROP_SCOPE:
+		val->intval = POWER_SUPPLY_SCOPE_SYSTEM;
+		return 0;
+
+	case POWER_SUPPLY_PROP_VOLTAGE_MAX_DESIGN:
+		val->intval = ocv_table[0].ocv;
+		return 0;
+
+	case POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN:
+		val->intval = ocv_table[ARRAY_SIZE(ocv_table) - 1].ocv;
+		return 0;
+
+	default:
+		break;
+	}
+
+	// Remaining properties are served from the last sample
+	if ((rc = input_battery_get(&reading))) {
+		return rc;
+	}
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		val->intval = reading.voltage_mv * 1000;
+		return 0;
+
+	case POWER_SUPPLY_PROP_CAPACITY:
+		val->intval = reading.capacity;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static struct power_supply_desc const battery_desc = {
+	.name = "beepy-battery",
+	.type = POWER_SUPPLY_TYPE_BATTERY,
+	.properties = battery_props,
+	.num_properties = ARRAY_SIZE(battery_props),
+	.get_property = battery_get_property,
+};
+
+// Public interface
+
+// Get last filtered battery reading
+int input_battery_get(struct battery_reading* reading)
+{
+	int rc;
+
+	mutex_lock(&g_battery_lock);
+	if ((rc = (g_reading_valid) ? 0 : -ENODATA) == 0) {
+		*reading = g_reading;
+	}
+	mutex_unlock(&g_battery_lock);
+
+	return rc;
+}
+
+// Set ADC sampling period, taking effect at the next sample
+void input_battery_set_period_ms(struct kbd_ctx* ctx, unsigned int period_ms)
+{
+	g_battery_period_ms = period_ms;
+	if (g_battery_ctx) {
+		mod_delayed_work(system_power_efficient_wq, &g_battery_work,
+			msecs_to_jiffies(period_ms));
+	}
+}
+
+// Stop sampling while suspended
+void input_battery_suspend(struct kbd_ctx* ctx)
+{
+	cancel_delayed_work_sync(&g_battery_work);
+}
+
+// Sample now, battery may have drained while suspended
+void input_battery_resume(struct kbd_ctx* ctx)
+{
+	if (g_battery_ctx) {
+		queue_delayed_work(system_power_efficient_wq, &g_battery_work, 0);
+	}
+}
+
+// Stop sampling if probe fails after sampling started, or on device release
+static void cancel_battery_work(void *data)
+{
+	g_battery_ctx = NULL;
+	cancel_delayed_work_sync(&g_battery_work);
+}
+
+int input_battery_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	int rc;
+	struct power_supply_config psy_cfg = {};
+
+	g_battery_ctx = NULL;
+	g_battery_psy = NULL;
+	mutex_init(&g_battery_lock);
+	INIT_DELAYED_WORK(&g_battery_work, battery_work_handler);
+	g_battery_period_ms = BBQX0KBD_BATTERY_PERIOD;
+	g_num_samples = 0;
+	g_next_sample = 0;
+	g_reading_valid = 0;
+
+	// Take first sample so that readings are available immediately
+	if (sample_battery(ctx) < 0) {
+		dev_warn(&i2c_client->dev,
+			"%s Could not read battery level, will retry\n", __func__);
+	}
+
+	// Register battery with power supply class
+	g_battery_psy = devm_power_supply_register(&i2c_client->dev,
+		&battery_desc, &psy_cfg);
+	if (IS_ERR(g_battery_psy)) {
+		dev_err(&i2c_client->dev,
+			"%s Could not register power supply: %ld\n",
+			__func__, PTR_ERR(g_battery_psy));
+		return PTR_ERR(g_battery_psy);
+	}
+
+	// Start sampling
+	g_battery_ctx = ctx;
+	queue_delayed_work(system_power_efficient_wq, &g_battery_work,
+		msecs_to_jiffies(g_battery_period_ms));
+	if ((rc = devm_add_action_or_reset(&i2c_client->dev,
+		cancel_battery_work, NULL))) {
+		return rc;
+	}
+
+	return 0;
+}
+
+void input_battery_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	g_battery_ctx = NULL;
+	cancel_delayed_work_sync(&g_battery_work);
+}
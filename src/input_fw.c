@@ -2,27 +2,94 @@
 // Input firmware subsystem
 
 #include <linux/input.h>
+#include <linux/workqueue.h>
 
 #include "config.h"
 #include "i2c_helper.h"
 #include "input_iface.h"
 
 #include "bbq20kbd_pmod_codes.h"
+#include "input_trace.h"
 
 // Globals
 static uint8_t g_brightness;
 static uint8_t g_last_brightness;
 static uint8_t g_handle_poweroff;
 
+// Backlight level fading towards target in timed steps, protected by
+// brightness lock. Dimmed while idle, restored to `g_brightness`
+static struct mutex g_brightness_lock;
+static struct kbd_ctx* g_fade_ctx;
+static struct delayed_work g_fade_work;
+static uint8_t g_backlight_level;
+static uint8_t g_fade_target;
+static int g_fade_steps;
+static uint8_t g_dimmed;
+static uint8_t g_suspended;
+
 // Helpers
 
+// Write backlight level, skipped by register cache if unchanged
+// Called with brightness lock held
+static void write_backlight_level(struct kbd_ctx* ctx, uint8_t level)
+{
+	if (!kbd_update_i2c_u8(ctx->i2c_client, REG_BKL, 0xff, level)) {
+		g_backlight_level = level;
+	}
+}
+
+// Set backlight level immediately, stopping any fade
+// Called with brightness lock held
+static void set_backlight_level(struct kbd_ctx* ctx, uint8_t level)
+{
+	g_fade_steps = 0;
+	g_dimmed = 0;
+	g_suspended = 0;
+	write_backlight_level(ctx, level);
+}
+
+// Fade to target level in a fixed number of steps
+// Called with brightness lock held
+static void start_fade(uint8_t target)
+{
+	g_fade_target = target;
+	g_fade_steps = BBQX0KBD_FADE_STEPS;
+	mod_delayed_work(system_power_efficient_wq, &g_fade_work, 0);
+}
+
+static void fade_work_handler(struct work_struct* work)
+{
+	int level;
+
+	mutex_lock(&g_brightness_lock);
+
+	// Fade was stopped
+	if ((g_fade_ctx == NULL) || g_suspended || (g_fade_steps <= 0)) {
+		mutex_unlock(&g_brightness_lock);
+		return;
+	}
+
+	// Cover the remaining distance evenly over the remaining steps
+	level = g_backlight_level
+		+ ((int)g_fade_target - (int)g_backlight_level) / g_fade_steps;
+	g_fade_steps--;
+	write_backlight_level(g_fade_ctx, (uint8_t)level);
+
+	if (g_fade_steps > 0) {
+		queue_delayed_work(system_power_efficient_wq, &g_fade_work,
+			msecs_to_jiffies(BBQX0KBD_FADE_STEP_MS));
+	}
+
+	mutex_unlock(&g_brightness_lock);
+}
+
 static void input_fw_run_poweroff(struct kbd_ctx* ctx)
 {
+	static const struct kbd_led_rgb red = {
+		.mode = REG_LED_MODE_ON, .r = 0xff, .g = 0x0, .b = 0x0 };
+
 	// Set LED to red
-	kbd_write_i2c_u8(ctx->i2c_client, REG_LED_R, 0xff);
-	kbd_write_i2c_u8(ctx->i2c_client, REG_LED_G, 0x0);
-	kbd_write_i2c_u8(ctx->i2c_client, REG_LED_B, 0x0);
-	kbd_write_i2c_u8(ctx->i2c_client, REG_LED, 0x1);
+	(void)input_leds_set(ctx, &red);
 
 	// Run poweroff
 	static const char * const poweroff_argv[] = {
@@ -40,6 +107,12 @@ int input_fw_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 	g_last_brightness = 0x00;
 	g_handle_poweroff = 0;
 
+	mutex_init(&g_brightness_lock);
+	INIT_DELAYED_WORK(&g_fade_work, fade_work_handler);
+	g_fade_ctx = ctx;
+	g_fade_steps = 0;
+	g_dimmed = 0;
+
 	// Get firmware version
 	if (kbd_read_i2c_u8(i2c_client, REG_VER, &ctx->version_number)) {
 		return -ENODEV;
@@ -77,6 +150,7 @@ int input_fw_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 
 	// Update keyboard brightness
 	(void)kbd_write_i2c_u8(i2c_client, REG_BKL, g_brightness);
+	g_backlight_level = g_brightness;
 
 	// Notify firmware that driver has initialized
 	// Clear boot indicator LED
@@ -93,6 +167,12 @@ void input_fw_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 	dev_info_fe(&i2c_client->dev,
 		"%s Shutting Down Keyboard And Screen Backlight.\n", __func__);
 
+	// Stop backlight fade
+	mutex_lock(&g_brightness_lock);
+	g_fade_ctx = NULL;
+	mutex_unlock(&g_brightness_lock);
+	cancel_delayed_work_sync(&g_fade_work);
+
 	// Turn off LED and notify firmware that driver has shut down
 	(void)kbd_write_i2c_u8(i2c_client, REG_LED, 0);
 	(void)kbd_write_i2c_u8(i2c_client, REG_DRIVER_STATE, 0);
@@ -126,28 +206,52 @@ int input_fw_consumes_keycode(struct kbd_ctx* ctx,
 
 void input_fw_decrease_brightness(struct kbd_ctx* ctx)
 {
+	uint8_t brightness;
+
+	mutex_lock(&g_brightness_lock);
+
 	// Decrease by delta, min at 0x0 brightness
 	g_brightness = (g_brightness < BBQ10_BRIGHTNESS_DELTA)
 		? 0x0
 		: g_brightness - BBQ10_BRIGHTNESS_DELTA;
 
 	// Set backlight using I2C
-	(void)kbd_write_i2c_u8(ctx->i2c_client, REG_BKL, g_brightness);
+	set_backlight_level(ctx, g_brightness);
+	brightness = g_brightness;
+
+	mutex_unlock(&g_brightness_lock);
+
+	// Notify LED class listeners of keyboard brightness change
+	input_leds_kbd_backlight_changed(brightness);
 }
 
 void input_fw_increase_brightness(struct kbd_ctx* ctx)
 {
+	uint8_t brightness;
+
+	mutex_lock(&g_brightness_lock);
+
 	// Increase by delta, max at 0xff brightness
 	g_brightness = (g_brightness > (0xff - BBQ10_BRIGHTNESS_DELTA))
 		? 0xff
 		: g_brightness + BBQ10_BRIGHTNESS_DELTA;
 
 	// Set backlight using I2C
-	(void)kbd_write_i2c_u8(ctx->i2c_client, REG_BKL, g_brightness);
+	set_backlight_level(ctx, g_brightness);
+	brightness = g_brightness;
+
+	mutex_unlock(&g_brightness_lock);
+
+	// Notify LED class listeners of keyboard brightness change
+	input_leds_kbd_backlight_changed(brightness);
 }
 
 void input_fw_toggle_brightness(struct kbd_ctx* ctx)
 {
+	uint8_t brightness;
+
+	mutex_lock(&g_brightness_lock);
+
 	// Toggle, save last brightness in context
 	if (g_last_brightness) {
 		g_brightness = g_last_brightness;
@@ -158,7 +262,70 @@ void input_fw_toggle_brightness(struct kbd_ctx* ctx)
 	}
 
 	// Set backlight using I2C
-	(void)kbd_write_i2c_u8(ctx->i2c_client, REG_BKL, g_brightness);
+	set_backlight_level(ctx, g_brightness);
+	brightness = g_brightness;
+
+	mutex_unlock(&g_brightness_lock);
+
+	// Notify LED class listeners of keyboard brightness change
+	input_leds_kbd_backlight_changed(brightness);
+}
+
+void input_fw_set_brightness(struct kbd_ctx* ctx, uint8_t brightness)
+{
+	mutex_lock(&g_brightness_lock);
+	g_brightness = brightness;
+	set_backlight_level(ctx, g_brightness);
+	mutex_unlock(&g_brightness_lock);
+}
+
+// Fade to new brightness, retargeting any fade in progress
+void input_fw_fade_brightness(struct kbd_ctx* ctx, uint8_t brightness)
+{
+	mutex_lock(&g_brightness_lock);
+	g_brightness = brightness;
+	g_dimmed = 0;
+	start_fade(g_brightness);
+	mutex_unlock(&g_brightness_lock);
+}
+
+uint8_t input_fw_get_brightness(void)
+{
+	return g_brightness;
+}
+
+// Fade backlight out while idle, and back to set brightness on input
+void input_fw_dim_backlight(struct kbd_ctx* ctx, uint8_t dimmed)
+{
+	mutex_lock(&g_brightness_lock);
+
+	if (dimmed != g_dimmed) {
+		g_dimmed = dimmed;
+		start_fade((dimmed) ? 0 : g_brightness);
+	}
+
+	mutex_unlock(&g_brightness_lock);
+}
+
+// Turn off backlight for system suspend
+void input_fw_suspend(struct kbd_ctx* ctx)
+{
+	mutex_lock(&g_brightness_lock);
+	g_suspended = 1;
+	g_fade_steps = 0;
+	mutex_unlock(&g_brightness_lock);
+	cancel_delayed_work_sync(&g_fade_work);
+
+	(void)kbd_write_i2c_u8(ctx->i2c_client, REG_BKL, 0);
+}
+
+// Restore backlight, or keep it off if idle dimming finished while suspended
+void input_fw_resume(struct kbd_ctx* ctx)
+{
+	mutex_lock(&g_brightness_lock);
+	g_suspended = 0;
+	write_backlight_level(ctx, (g_dimmed) ? 0 : g_brightness);
+	mutex_unlock(&g_brightness_lock);
 }
 
 // I2C helpers
@@ -166,23 +333,17 @@ void input_fw_toggle_brightness(struct kbd_ctx* ctx)
 int input_fw_enable_touch_interrupts(struct kbd_ctx* ctx)
 {
 	int rc;
-	uint8_t reg_value;
-
-	// Get old CF2 value
-	if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_CF2, &reg_value))) {
-		return rc;
-	}
 
 	// Set touch interrupt bit
-	reg_value |= REG_CF2_TOUCH_INT;
-
-	// Write new CF2 value
-	if ((rc = kbd_write_i2c_u8(ctx->i2c_client, REG_CF2, reg_value))) {
+	if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_CF2,
+		REG_CF2_TOUCH_INT, REG_CF2_TOUCH_INT))) {
 		return rc;
 	}
 
 	// Set touch state
+	mutex_lock(&ctx->read_lock);
 	ctx->raised_touch_event = 1;
+	mutex_unlock(&ctx->read_lock);
 
 	return 0;
 }
@@ -190,38 +351,65 @@ int input_fw_enable_touch_interrupts(struct kbd_ctx* ctx)
 int input_fw_disable_touch_interrupts(struct kbd_ctx* ctx)
 {
 	int rc;
-	uint8_t reg_value;
-
-	// Get old CF2 value
-	if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_CF2, &reg_value))) {
-		return rc;
-	}
 
 	// Clear touch interrupt bit
-	reg_value &= ~REG_CF2_TOUCH_INT;
-
-	// Write new CF2 value
-	if ((rc = kbd_write_i2c_u8(ctx->i2c_client, REG_CF2, reg_value))) {
+	if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_CF2,
+		REG_CF2_TOUCH_INT, 0))) {
 		return rc;
 	}
 
 	// Clear touch state
+	mutex_lock(&ctx->read_lock);
 	ctx->raised_touch_event = 0;
+	mutex_unlock(&ctx->read_lock);
 
 	return 0;
 }
 
-// Transfer from I2C FIFO to internal context FIFO
-void input_fw_read_fifo(struct kbd_ctx* ctx)
+// Mask key and touch interrupts while driver polls for events
+int input_fw_mask_interrupts(struct kbd_ctx* ctx)
 {
-	uint8_t fifo_idx;
 	int rc;
 
-	// Read number of FIFO items
-	if (kbd_read_i2c_u8(ctx->i2c_client, REG_KEY, &ctx->key_fifo_count)) {
-		return;
+	// Clear key interrupt bit, overflow interrupts remain enabled
+	if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_CFG,
+		REG_CFG_KEY_INT, 0))) {
+		return rc;
+	}
+
+	if (!ctx->touch.enabled) {
+		return 0;
+	}
+
+	// Clear touch interrupt bit
+	return kbd_update_i2c_u8(ctx->i2c_client, REG_CF2, REG_CF2_TOUCH_INT, 0);
+}
+
+// Restore key and touch interrupts after polling
+int input_fw_unmask_interrupts(struct kbd_ctx* ctx)
+{
+	int rc;
+
+	// Restore key interrupt bit
+	if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_CFG,
+		REG_CFG_KEY_INT, REG_CFG_KEY_INT))) {
+		return rc;
 	}
-	ctx->key_fifo_count &= REG_KEY_KEYCOUNT_MASK;
+
+	if (!ctx->touch.enabled) {
+		return 0;
+	}
+
+	// Set touch interrupt bit
+	return kbd_update_i2c_u8(ctx->i2c_client, REG_CF2,
+		REG_CF2_TOUCH_INT, REG_CF2_TOUCH_INT);
+}
+
+// Read FIFO items one at a time with a word read per item
+static int read_fifo_per_item(struct kbd_ctx* ctx)
+{
+	uint8_t fifo_idx;
+	int rc;
 
 	// Read and transfer all FIFO items
 	for (fifo_idx = 0; fifo_idx < ctx->key_fifo_count; fifo_idx++) {
@@ -232,10 +420,43 @@ void input_fw_read_fifo(struct kbd_ctx* ctx)
 
 			dev_err(&ctx->i2c_client->dev,
 				"%s Could not read REG_FIF, Error: %d\n", __func__, rc);
-			return;
+			ctx->key_fifo_count = fifo_idx;
+			return rc;
 		}
+	}
+
+	return 0;
+}
 
-		// Advance FIFO position
+// Clamp key count read from client and record FIFO depth
+// if key events were pending
+static void set_fifo_count(struct kbd_ctx* ctx, uint8_t reg_key)
+{
+	ctx->key_fifo_count = reg_key & REG_KEY_KEYCOUNT_MASK;
+	if (ctx->key_fifo_count > BBQX0KBD_FIFO_SIZE) {
+		ctx->key_fifo_count = BBQX0KBD_FIFO_SIZE;
+	}
+	if (ctx->key_fifo_count) {
+		atomic_long_inc(&ctx->stats.fifo_depth[ctx->key_fifo_count]);
+	}
+}
+
+// Transfer `key_fifo_count` items from I2C FIFO to internal context FIFO
+static void read_fifo_items(struct kbd_ctx* ctx)
+{
+#if (DEBUG_LEVEL & DEBUG_LEVEL_FE)
+	uint8_t fifo_idx;
+#endif
+
+	if (ctx->key_fifo_count == 0) {
+		return;
+	}
+
+	(void)read_fifo_per_item(ctx);
+	trace_beepy_kbd_fifo_read(ctx->key_fifo_count);
+
+#if (DEBUG_LEVEL & DEBUG_LEVEL_FE)
+	for (fifo_idx = 0; fifo_idx < ctx->key_fifo_count; fifo_idx++) {
 		dev_info_fe(&ctx->i2c_client->dev,
 			"%s %02d: 0x%02x%02x State %d Scancode %d\n",
 			__func__, fifo_idx,
@@ -244,68 +465,104 @@ void input_fw_read_fifo(struct kbd_ctx* ctx)
 			ctx->key_fifo_data[fifo_idx].state,
 			ctx->key_fifo_data[fifo_idx].scancode);
 	}
+#endif
+}
+
+// Transfer from I2C FIFO to internal context FIFO
+void input_fw_read_fifo(struct kbd_ctx* ctx)
+{
+	uint8_t reg_key;
+
+	// Read number of FIFO items
+	if (kbd_read_i2c_u8(ctx->i2c_client, REG_KEY, &reg_key)) {
+		ctx->key_fifo_count = 0;
+		return;
+	}
+	set_fifo_count(ctx, reg_key);
+
+	read_fifo_items(ctx);
 }
 
 // RTC helpers
 
+// Read RTC registers from seconds to year
+// Firmware does not advance the register address within a transfer,
+// so each register is read in its own transfer
+static int read_rtc_regs(struct kbd_ctx* ctx, uint8_t* regs)
+{
+	int rc, i;
+
+	for (i = 0; i < RTC_NUM_REGS; i++) {
+		if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_RTC_SEC + i, &regs[i]))) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
 int input_fw_get_rtc(uint8_t* year, uint8_t* mon, uint8_t* day,
 	uint8_t* hour, uint8_t* min, uint8_t* sec)
 {
-	int rc;
+	int rc, attempt;
+	uint8_t regs[RTC_NUM_REGS], check_sec;
 
 	if (!g_ctx || !g_ctx->i2c_client) {
 		return -EAGAIN;
 	}
 
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_YEAR, year))) {
-		return rc;
-	}
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_MON, mon))) {
-		return rc;
-	}
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_MDAY, day))) {
-		return rc;
-	}
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_HOUR, hour))) {
-		return rc;
-	}
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_MIN, min))) {
-		return rc;
+	// Seconds are read first. If they have not wrapped by the time the
+	// range is read, no field rolled over during the read
+	for (attempt = 0; attempt < BBQX0KBD_RTC_READ_ATTEMPTS; attempt++) {
+		if ((rc = read_rtc_regs(g_ctx, regs))
+		 || (rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_SEC, &check_sec))) {
+			return rc;
+		}
+		if (check_sec >= regs[REG_RTC_SEC - REG_RTC_SEC]) {
+			break;
+		}
 	}
-	if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_RTC_SEC, sec))) {
-		return rc;
+	if (attempt == BBQX0KBD_RTC_READ_ATTEMPTS) {
+		return -EIO;
 	}
 
+	*sec = regs[REG_RTC_SEC - REG_RTC_SEC];
+	*min = regs[REG_RTC_MIN - REG_RTC_SEC];
+	*hour = regs[REG_RTC_HOUR - REG_RTC_SEC];
+	*day = regs[REG_RTC_MDAY - REG_RTC_SEC];
+	*mon = regs[REG_RTC_MON - REG_RTC_SEC];
+	*year = regs[REG_RTC_YEAR - REG_RTC_SEC];
+
 	return 0;
 }
 
 int input_fw_set_rtc(uint8_t year, uint8_t mon, uint8_t day,
 	uint8_t hour, uint8_t min, uint8_t sec)
 {
-	int rc;
+	int rc, i;
+	uint8_t regs[RTC_NUM_REGS];
 
 	if (!g_ctx || !g_ctx->i2c_client) {
 		return -EAGAIN;
 	}
 
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_YEAR, year))) {
-		return rc;
-	}
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_MON, mon))) {
-		return rc;
-	}
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_MDAY, day))) {
-		return rc;
-	}
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_HOUR, hour))) {
-		return rc;
-	}
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_MIN, min))) {
-		return rc;
-	}
-	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_SEC, sec))) {
-		return rc;
+	regs[REG_RTC_SEC - REG_RTC_SEC] = sec;
+	regs[REG_RTC_MIN - REG_RTC_SEC] = min;
+	regs[REG_RTC_HOUR - REG_RTC_SEC] = hour;
+	regs[REG_RTC_MDAY - REG_RTC_SEC] = day;
+	regs[REG_RTC_MON - REG_RTC_SEC] = mon;
+	regs[REG_RTC_YEAR - REG_RTC_SEC] = year;
+
+	// Write one register at a time, multi-register writes are not supported.
+	// Fields are staged by firmware and applied together on commit
+	for (i = 0; i < RTC_NUM_REGS; i++) {
+		if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_SEC + i,
+			regs[i]))) {
+			return rc;
+		}
 	}
+
+	// New time takes effect on commit
 	if ((rc = kbd_write_i2c_u8(g_ctx->i2c_client, REG_RTC_COMMIT, 0x1))) {
 		return rc;
 	}
@@ -320,22 +577,49 @@ void input_fw_set_handle_poweroff(struct kbd_ctx* ctx, uint8_t handle_poweroff)
 
 void input_fw_set_auto_off(struct kbd_ctx* ctx, uint8_t auto_off)
 {
-	uint8_t reg_value;
+	// Update auto-off bit
+	(void)kbd_update_i2c_u8(ctx->i2c_client, REG_CF2,
+		REG_CF2_AUTO_OFF, (auto_off) ? REG_CF2_AUTO_OFF : 0);
+}
 
-	// Get original value
-	if (kbd_read_i2c_u8(ctx->i2c_client, REG_CF2, &reg_value)) {
-		return;
-	}
+// Rewrite cached configuration registers after a firmware reset
+int input_fw_resync(struct kbd_ctx* ctx)
+{
+	int rc;
 
-	// Update auto-off bit
-	if (auto_off) {
-		reg_value |= REG_CF2_AUTO_OFF;
-	} else {
-		reg_value &= ~REG_CF2_AUTO_OFF;
+	// Write back all cached register values
+	regcache_mark_dirty(ctx->regmap);
+	if ((rc = regcache_sync(ctx->regmap))) {
+		dev_err(&ctx->i2c_client->dev,
+			"%s Could not restore registers: %d\n", __func__, rc);
+		return rc;
 	}
 
-	// Update value
-	if (kbd_write_i2c_u8(ctx->i2c_client, REG_CF2, reg_value)) {
+	// Colors were restored, apply them with the driver's LED mode
+	input_leds_resync(ctx);
+
+	// Rewrite indirect touchpad registers
+	input_touch_resync(ctx);
+
+	// Notify firmware that driver is running
+	(void)kbd_write_i2c_u8(ctx->i2c_client, REG_DRIVER_STATE, 1);
+
+	ctx->shadow.resyncs++;
+
+	return 0;
+}
+
+// Firmware clears driver state when it restarts
+void input_fw_check_reset(struct kbd_ctx* ctx)
+{
+	uint8_t driver_state;
+
+	if (kbd_read_i2c_u8(ctx->i2c_client, REG_DRIVER_STATE, &driver_state)
+	 || driver_state) {
 		return;
 	}
+
+	dev_warn(&ctx->i2c_client->dev,
+		"%s firmware reset detected, restoring configuration\n", __func__);
+	(void)input_fw_resync(ctx);
 }
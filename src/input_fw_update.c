@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Firmware update subsystem
+
+#include <linux/firmware.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "config.h"
+#include "i2c_helper.h"
+#include "input_iface.h"
+
+// Globals
+
+static struct kbd_ctx* g_update_ctx;
+
+// Serializes fw_update writes and fw_update_file requests
+static struct mutex g_update_lock;
+
+// Image name requested through fw_update_file
+static char g_firmware_name[NAME_MAX];
+static uint8_t g_firmware_pending;
+
+static struct work_struct g_update_work;
+static uint8_t g_stopping;
+
+// Progress, and whether update is loaded with request_firmware,
+// protected by progress lock
+static struct mutex g_progress_lock;
+static struct fw_update_progress g_progress;
+static uint8_t g_file_update;
+
+// Helpers
+
+// Write image data to firmware
+// Firmware receives one update byte per register write
+static int write_update_data(struct kbd_ctx* ctx, uint8_t const* data, size_t len)
+{
+	int rc;
+
+	while (len > 0) {
+
+		if (g_stopping) {
+			return -ESHUTDOWN;
+		}
+
+		if ((rc = kbd_write_i2c_u8(ctx->i2c_client, REG_UPDATE_DATA, *data))) {
+			return rc;
+		}
+
+		data++;
+		len--;
+
+		mutex_lock(&g_progress_lock);
+		g_progress.bytes_written++;
+		mutex_unlock(&g_progress_lock);
+	}
+
+	return 0;
+}
+
+// Read update state from firmware into progress
+static int read_update_state(struct kbd_ctx* ctx)
+{
+	int rc;
+	uint8_t update_state;
+
+	if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_UPDATE_DATA, &update_state))) {
+		return rc;
+	}
+
+	mutex_lock(&g_progress_lock);
+	g_progress.state = update_state;
+	mutex_unlock(&g_progress_lock);
+
+	if (update_state >= UPDATE_FAILED) {
+		dev_info(&ctx->i2c_client->dev,
+			"fw_update: failed: %s\n", input_fw_update_error(update_state));
+	} else if (update_state == UPDATE_OFF) {
+		dev_info(&ctx->i2c_client->dev,
+			"fw_update: wrote %zu bytes, update completed\n",
+			g_progress.bytes_written);
+	}
+
+	return 0;
+}
+
+// Reset progress for a new update of `total` bytes, or 0 if unknown
+static void start_progress(size_t total)
+{
+	mutex_lock(&g_progress_lock);
+	g_progress.running = 1;
+	g_progress.error = 0;
+	g_progress.state = UPDATE_RECV;
+	g_progress.bytes_written = 0;
+	g_progress.bytes_total = total;
+	g_progress.started_at = ktime_get_boottime_ns();
+	mutex_unlock(&g_progress_lock);
+}
+
+// Write image loaded with request_firmware
+static void update_from_firmware(struct kbd_ctx* ctx)
+{
+	int rc;
+	const struct firmware *fw;
+
+	if ((rc = request_firmware(&fw, g_firmware_name, &ctx->i2c_client->dev))) {
+		dev_err(&ctx->i2c_client->dev,
+			"fw_update: could not load %s: %d\n", g_firmware_name, rc);
+		mutex_lock(&g_progress_lock);
+		g_progress.error = rc;
+		mutex_unlock(&g_progress_lock);
+		return;
+	}
+
+	dev_info(&ctx->i2c_client->dev,
+		"fw_update: starting update from %s, writing %zu bytes\n",
+		g_firmware_name, fw->size);
+	start_progress(fw->size);
+
+	if ((rc = write_update_data(ctx, fw->data, fw->size))) {
+		mutex_lock(&g_progress_lock);
+		g_progress.error = rc;
+		mutex_unlock(&g_progress_lock);
+	}
+
+	release_firmware(fw);
+}
+
+static void input_fw_update_work_handler(struct work_struct *work)
+{
+	struct kbd_ctx* ctx;
+
+	ctx = g_update_ctx;
+
+	if (g_firmware_pending) {
+		g_firmware_pending = 0;
+		update_from_firmware(ctx);
+	}
+
+	(void)read_update_state(ctx);
+
+	mutex_lock(&g_progress_lock);
+	g_progress.running = 0;
+	g_file_update = 0;
+	mutex_unlock(&g_progress_lock);
+}
+
+char const* input_fw_update_error(uint8_t update_state)
+{
+	switch (update_state) {
+	case UPDATE_FAILED_LINE_OVERFLOW: return "hex line too long";
+	case UPDATE_FAILED_FLASH_EMPTY: return "flash image empty";
+	case UPDATE_FAILED_FLASH_OVERFLOW: return "flash image > 64k";
+	case UPDATE_FAILED_BAD_LINE: return "could not parse hex line";
+	case UPDATE_FAILED_BAD_CHECKSUM: return "bad checksum";
+	}
+
+	return "update failed";
+}
+
+// Write image data to firmware before returning, so that a transfer
+// error or a rejected image is reported to the writer
+ssize_t input_fw_update_write(struct kbd_ctx* ctx, char const* buf, size_t count)
+{
+	int rc;
+	size_t written;
+	uint8_t busy, failed, update_state;
+
+	mutex_lock(&g_update_lock);
+
+	// Image loaded from fw_update_file is being written
+	mutex_lock(&g_progress_lock);
+	busy = g_file_update;
+	mutex_unlock(&g_progress_lock);
+	if (busy) {
+		mutex_unlock(&g_update_lock);
+		return -EBUSY;
+	}
+
+	// Header line restarts update
+	if ((count > 0) && (buf[0] == '+')) {
+		dev_info(&ctx->i2c_client->dev,
+			"fw_update: starting new update\n");
+		start_progress(0);
+	}
+
+	// Firmware rejected the image, writer must restart with header
+	mutex_lock(&g_progress_lock);
+	failed = (g_progress.state >= UPDATE_FAILED) || g_progress.error;
+	written = g_progress.bytes_written;
+	g_progress.running = !failed;
+	mutex_unlock(&g_progress_lock);
+	if (failed) {
+		mutex_unlock(&g_update_lock);
+		return -EIO;
+	}
+
+	rc = write_update_data(ctx, (uint8_t const*)buf, count);
+
+	// Streamed image size is only known as data is written
+	mutex_lock(&g_progress_lock);
+	g_progress.bytes_total += g_progress.bytes_written - written;
+	if (rc) {
+		g_progress.error = rc;
+	}
+	mutex_unlock(&g_progress_lock);
+
+	if (!rc) {
+		rc = read_update_state(ctx);
+	}
+
+	mutex_lock(&g_progress_lock);
+	g_progress.running = 0;
+	update_state = g_progress.state;
+	mutex_unlock(&g_progress_lock);
+
+	mutex_unlock(&g_update_lock);
+
+	if (rc) {
+		return rc;
+	} else if (update_state >= UPDATE_FAILED) {
+		return -EINVAL;
+	}
+
+	return count;
+}
+
+// Load named image with request_firmware and write it in the background
+int input_fw_update_request(struct kbd_ctx* ctx, char const* name)
+{
+	mutex_lock(&g_update_lock);
+
+	mutex_lock(&g_progress_lock);
+	if (g_progress.running) {
+		mutex_unlock(&g_progress_lock);
+		mutex_unlock(&g_update_lock);
+		return -EBUSY;
+	}
+	g_progress.running = 1;
+	g_progress.error = 0;
+	g_file_update = 1;
+	mutex_unlock(&g_progress_lock);
+
+	// Strip trailing newline from sysfs write
+	strscpy(g_firmware_name, name, sizeof(g_firmware_name));
+	g_firmware_name[strcspn(g_firmware_name, "\n")] = '\0';
+	g_firmware_pending = 1;
+
+	queue_work(system_long_wq, &g_update_work);
+
+	mutex_unlock(&g_update_lock);
+
+	return 0;
+}
+
+void input_fw_update_get_progress(struct fw_update_progress* progress)
+{
+	mutex_lock(&g_progress_lock);
+	*progress = g_progress;
+	mutex_unlock(&g_progress_lock);
+}
+
+// Stop writing image if probe fails after this point, or on device release
+static void cancel_update_work(void *data)
+{
+	g_stopping = 1;
+	cancel_work_sync(&g_update_work);
+}
+
+int input_fw_update_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	g_update_ctx = ctx;
+
+	mutex_init(&g_update_lock);
+	mutex_init(&g_progress_lock);
+	INIT_WORK(&g_update_work, input_fw_update_work_handler);
+
+	g_firmware_pending = 0;
+	g_file_update = 0;
+	g_stopping = 0;
+	memset(&g_progress, 0, sizeof(g_progress));
+
+	return devm_add_action_or_reset(&i2c_client->dev, cancel_update_work, NULL);
+}
+
+void input_fw_update_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	// Stop writing image
+	cancel_update_work(NULL);
+}
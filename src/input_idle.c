@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Input idle subsystem
+
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+
+#include "config.h"
+#include "input_iface.h"
+#include "sysfs_iface.h"
+
+// Runs `enter` once `period_ms` passes without a keypress,
+// and `exit` on the first keypress after that
+struct idle_timer
+{
+	struct delayed_work work;
+	unsigned int period_ms;
+	atomic_t idle;
+
+	void (*enter)(struct kbd_ctx* ctx);
+	void (*exit)(struct kbd_ctx* ctx);
+};
+
+// Globals
+
+static struct kbd_ctx* g_idle_ctx;
+
+// Notifies last_keypress pollers
+static struct idle_timer g_notify_timer;
+
+// Dims keyboard backlight and, if enabled, touchpad LED
+static struct idle_timer g_dim_timer;
+static uint8_t g_dim_touch_led;
+
+// Helpers
+
+// Work is frozen during system suspend, so dimming does not write to
+// firmware after the I2C adapter has suspended
+static void arm_idle_timer(struct idle_timer* timer, unsigned long delay)
+{
+	queue_delayed_work(system_freezable_power_efficient_wq, &timer->work, delay);
+}
+
+static void idle_work_handler(struct work_struct* work)
+{
+	struct idle_timer* timer;
+	struct kbd_ctx* ctx;
+	uint64_t now, idle_at;
+
+	timer = container_of(to_delayed_work(work), struct idle_timer, work);
+
+	// Stopped, disabled, or already idle
+	if (((ctx = g_idle_ctx) == NULL) || (timer->period_ms == 0)
+	 || atomic_read(&timer->idle)) {
+		return;
+	}
+
+	// Keys were pressed since work was queued, check again after the rest
+	// of the idle period. Keypresses only update the timestamp
+	now = ktime_get_boottime_ns();
+	idle_at = ctx->last_keypress_at + (uint64_t)timer->period_ms * NSEC_PER_MSEC;
+	if (now < idle_at) {
+		arm_idle_timer(timer, nsecs_to_jiffies(idle_at - now) + 1);
+		return;
+	}
+
+	// Entered idle
+	atomic_set(&timer->idle, 1);
+	timer->enter(ctx);
+}
+
+static void idle_timer_activity(struct kbd_ctx* ctx, struct idle_timer* timer)
+{
+	// First keypress after idle period
+	if (atomic_xchg(&timer->idle, 0)) {
+		timer->exit(ctx);
+		arm_idle_timer(timer, msecs_to_jiffies(timer->period_ms));
+	}
+}
+
+// Set idle period, 0 to disable, and check against new period now
+static void set_idle_timer_period(struct kbd_ctx* ctx, struct idle_timer* timer,
+	unsigned int period_ms)
+{
+	timer->period_ms = period_ms;
+
+	if (g_idle_ctx) {
+		if (atomic_xchg(&timer->idle, 0)) {
+			timer->exit(ctx);
+		}
+		mod_delayed_work(system_freezable_power_efficient_wq, &timer->work, 0);
+	}
+}
+
+static void init_idle_timer(struct idle_timer* timer, unsigned int period_ms,
+	void (*enter)(struct kbd_ctx* ctx), void (*exit)(struct kbd_ctx* ctx))
+{
+	INIT_DELAYED_WORK(&timer->work, idle_work_handler);
+	timer->period_ms = period_ms;
+	atomic_set(&timer->idle, 0);
+	timer->enter = enter;
+	timer->exit = exit;
+}
+
+static void stop_idle_timer(struct idle_timer* timer)
+{
+	cancel_delayed_work_sync(&timer->work);
+}
+
+// Idle notifications
+
+static void notify_idle_changed(struct kbd_ctx* ctx)
+{
+	sysfs_notify_last_keypress();
+}
+
+// Idle dimming
+
+static void dim_enter(struct kbd_ctx* ctx)
+{
+	input_fw_dim_backlight(ctx, 1);
+	if (g_dim_touch_led) {
+		input_touch_dim_led(ctx, 1);
+	}
+}
+
+static void dim_exit(struct kbd_ctx* ctx)
+{
+	input_fw_dim_backlight(ctx, 0);
+	input_touch_dim_led(ctx, 0);
+}
+
+// Public interface
+
+// Called after each keypress
+void input_idle_activity(struct kbd_ctx* ctx)
+{
+	idle_timer_activity(ctx, &g_notify_timer);
+	idle_timer_activity(ctx, &g_dim_timer);
+}
+
+uint8_t input_idle_is_idle(void)
+{
+	return atomic_read(&g_notify_timer.idle);
+}
+
+// Set idle notification period, 0 to disable
+void input_idle_set_timeout_ms(struct kbd_ctx* ctx, unsigned int idle_ms)
+{
+	set_idle_timer_period(ctx, &g_notify_timer, idle_ms);
+}
+
+// Set backlight dimming period, 0 to disable
+void input_idle_set_dim_ms(struct kbd_ctx* ctx, unsigned int dim_ms)
+{
+	set_idle_timer_period(ctx, &g_dim_timer, dim_ms);
+}
+
+// Also lower touchpad LED power when dimming
+void input_idle_set_dim_touch_led(struct kbd_ctx* ctx, uint8_t dim_touch_led)
+{
+	g_dim_touch_led = dim_touch_led;
+}
+
+// Stop idle timers if probe fails after they started, or on device release
+static void cancel_idle_timers(void *data)
+{
+	g_idle_ctx = NULL;
+	stop_idle_timer(&g_notify_timer);
+	stop_idle_timer(&g_dim_timer);
+}
+
+int input_idle_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	int rc;
+
+	init_idle_timer(&g_notify_timer, BBQX0KBD_IDLE_PERIOD,
+		notify_idle_changed, notify_idle_changed);
+	init_idle_timer(&g_dim_timer, 0, dim_enter, dim_exit);
+	g_dim_touch_led = 1;
+
+	// Start checking for idle
+	g_idle_ctx = ctx;
+	arm_idle_timer(&g_notify_timer, msecs_to_jiffies(g_notify_timer.period_ms));
+	if ((rc = devm_add_action_or_reset(&i2c_client->dev,
+		cancel_idle_timers, NULL))) {
+		return rc;
+	}
+
+	return 0;
+}
+
+void input_idle_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	g_idle_ctx = NULL;
+	stop_idle_timer(&g_notify_timer);
+	stop_idle_timer(&g_dim_timer);
+}
@@ -4,8 +4,12 @@
  * input_iface.c: Key handler implementation
  */
 
+#include <linux/version.h>
 #include <linux/input.h>
 #include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/sched/prio.h>
 
 #include "config.h"
 #include "debug_levels.h"
@@ -14,22 +18,56 @@
 #include "input_iface.h"
 
 #include "i2c_helper.h"
+#include "i2c_regmap.h"
 
 #include "bbq20kbd_pmod_codes.h"
 
+#define CREATE_TRACE_POINTS
+#include "input_trace.h"
+
 // Global keyboard context and sysfs data
 struct kbd_ctx *g_ctx = NULL;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+
+// Scheduling policy helpers were added in 5.9, set the same policies directly
+
+static void sched_set_normal(struct task_struct *p, int nice)
+{
+	struct sched_param sp = { .sched_priority = 0 };
+
+	sched_setscheduler_nocheck(p, SCHED_NORMAL, &sp);
+	set_user_nice(p, nice);
+}
+
+static void sched_set_fifo_low(struct task_struct *p)
+{
+	struct sched_param sp = { .sched_priority = 1 };
+
+	sched_setscheduler_nocheck(p, SCHED_FIFO, &sp);
+}
+
+static void sched_set_fifo(struct task_struct *p)
+{
+	struct sched_param sp = { .sched_priority = MAX_RT_PRIO / 2 };
+
+	sched_setscheduler_nocheck(p, SCHED_FIFO, &sp);
+}
+
+#endif
+
 // Main key event handler
-static void key_report_event(struct kbd_ctx* ctx,
-	struct key_fifo_item const* ev)
+// Synthesized events were not typed and do not count as keypress activity
+// Returns which subsystem consumed the key event
+static enum key_consumer __key_report_event(struct kbd_ctx* ctx,
+	struct key_fifo_item const* ev, uint8_t synthesized)
 {
 	uint8_t keycode;
 
 	// Only handle key pressed, held, or released events
 	if ((ev->state != KEY_STATE_PRESSED) && (ev->state != KEY_STATE_RELEASED)
 	 && (ev->state != KEY_STATE_HOLD)) {
-		return;
+		return KEY_CONSUMER_NONE;
 	}
 
 	// Post key scan event
@@ -43,18 +81,21 @@ static void key_report_event(struct kbd_ctx* ctx,
 
 	// Scancode mapped to ignored keycode
 	if (keycode == 0) {
-		return;
+		return KEY_CONSUMER_NONE;
 
 	// Scancode converted to keycode not in map
 	} else if (keycode == KEY_UNKNOWN) {
 		dev_warn(&ctx->i2c_client->dev,
 			"%s Could not get Keycode for Scancode: [0x%02X]\n",
 			__func__, ev->scancode);
-		return;
+		return KEY_CONSUMER_NONE;
 	}
 
 	// Update last keypress time
-	g_ctx->last_keypress_at = ktime_get_boottime_ns();
+	if (!synthesized) {
+		g_ctx->last_keypress_at = ktime_get_boottime_ns();
+		input_idle_activity(ctx);
+	}
 
 	if (keycode == KEY_STOP) {
 
@@ -72,20 +113,23 @@ static void key_report_event(struct kbd_ctx* ctx,
 			input_report_key(ctx->input_dev, 174, FALSE);
 			input_report_key(ctx->input_dev, KEY_LEFTCTRL, FALSE);
 		}
-		return;
+		return KEY_CONSUMER_POWER;
 	}
 
 	// Subsystem key handling
-	if (input_fw_consumes_keycode(ctx, &keycode, keycode, ev->state)
-	 || input_touch_consumes_keycode(ctx, &keycode, keycode, ev->state)
-	 || input_modifiers_consumes_keycode(ctx, &keycode, keycode, ev->state)
-	 || input_meta_consumes_keycode(ctx, &keycode, keycode, ev->state)) {
-		return;
+	if (input_fw_consumes_keycode(ctx, &keycode, keycode, ev->state)) {
+		return KEY_CONSUMER_FW;
+	} else if (input_touch_consumes_keycode(ctx, &keycode, keycode, ev->state)) {
+		return KEY_CONSUMER_TOUCH;
+	} else if (input_modifiers_consumes_keycode(ctx, &keycode, keycode, ev->state)) {
+		return KEY_CONSUMER_MODIFIERS;
+	} else if (input_meta_consumes_keycode(ctx, &keycode, keycode, ev->state)) {
+		return KEY_CONSUMER_META;
 	}
 
 	// Ignore hold keys at this point
 	if (ev->state == KEY_STATE_HOLD) {
-		return;
+		return KEY_CONSUMER_NONE;
 	}
 
 	// Apply pending sticky modifiers
@@ -96,98 +140,680 @@ static void key_report_event(struct kbd_ctx* ctx,
 
 	// Reset sticky modifiers
 	input_modifiers_reset(ctx);
+
+	return KEY_CONSUMER_PASSTHROUGH;
 }
 
-static irqreturn_t input_irq_handler(int irq, void *param)
+static void key_report_event(struct kbd_ctx* ctx,
+	struct key_fifo_item const* ev, uint8_t synthesized)
 {
-	struct kbd_ctx *ctx;
+	enum key_consumer consumer;
+
+	// Synthesized releases are counted separately by overflow recovery
+	consumer = __key_report_event(ctx, ev, synthesized);
+	if (!synthesized) {
+		atomic_long_inc(&ctx->stats.keys[consumer]);
+	}
+
+	// Track pressed scancodes for overflow recovery
+	if (ev->state == KEY_STATE_RELEASED) {
+		__clear_bit(ev->scancode, ctx->pressed_scancodes);
+	} else if (ev->state != KEY_STATE_IDLE) {
+		__set_bit(ev->scancode, ctx->pressed_scancodes);
+	}
+	trace_beepy_kbd_key(ev->scancode, ev->state,
+		ctx->keycode_map[ev->scancode], consumer);
+}
+
+// Firmware dropped events on overflow, so release events may be lost.
+// Release any key not reported pressed or held since the overflow,
+// then reset modifier and meta state
+static void recover_key_state(struct kbd_ctx* ctx, unsigned long const* seen)
+{
+	struct key_fifo_item ev;
+	DECLARE_BITMAP(held_keycodes, KEY_CNT);
+	unsigned int scancode, keycode;
+	unsigned int released;
+
+	released = 0;
+	bitmap_zero(held_keycodes, KEY_CNT);
+
+	// Synthesize release through subsystems so their state is updated
+	for_each_set_bit(scancode, ctx->pressed_scancodes, NUM_SCANCODES) {
+		if (test_bit(scancode, seen)) {
+			__set_bit(ctx->keycode_map[scancode], held_keycodes);
+			continue;
+		}
+		ev.scancode = scancode;
+		ev.state = KEY_STATE_RELEASED;
+		key_report_event(ctx, &ev, 1);
+		released++;
+	}
+
+	// Clear sticky modifiers and exit meta mode
+	input_modifiers_clear(ctx);
+	input_meta_disable(ctx);
+
+	// Release anything the input system still has down from remapped keys
+	for_each_set_bit(keycode, ctx->input_dev->key, KEY_CNT) {
+		if (test_bit(keycode, held_keycodes)) {
+			continue;
+		}
+		input_report_key(ctx->input_dev, keycode, FALSE);
+		released++;
+	}
+
+	atomic_long_inc(&ctx->stats.overflow_recoveries);
+	atomic_long_add(released, &ctx->stats.synthesized_releases);
+	dev_warn(&ctx->i2c_client->dev,
+		"%s recovered from overflow, released %u keys\n",
+		__func__, released);
+}
+
+// Move items read from the firmware FIFO into the key event ring
+// Items in a batch were queued by the firmware some time before `at`,
+// so spread their timestamps back toward the previous batch
+static void queue_fifo_items(struct kbd_ctx* ctx, ktime_t at)
+{
+	struct key_ring_item item;
+	unsigned int queued, len, i;
+	s64 step_ns;
+
+	if (ctx->key_fifo_count == 0) {
+		return;
+	}
+
+	// Spacing between items, last item gets the batch time
+	step_ns = ktime_to_ns(ktime_sub(at, ctx->last_batch_at))
+		/ ctx->key_fifo_count;
+	step_ns = clamp_t(s64, step_ns, 0, BBQX0KBD_BATCH_SPREAD_US * NSEC_PER_USEC);
+	ctx->last_batch_at = at;
+
+	// Ring is full if worker has fallen behind, count dropped items
+	queued = 0;
+	for (i = 0; i < ctx->key_fifo_count; i++) {
+		item.ev = ctx->key_fifo_data[i];
+		item.at = ktime_sub_ns(at, (ctx->key_fifo_count - 1 - i) * step_ns);
+		if (!kfifo_put(&ctx->key_ring, item)) {
+			break;
+		}
+		queued++;
+	}
+	if (queued < ctx->key_fifo_count) {
+		ctx->key_ring_dropped += ctx->key_fifo_count - queued;
+		dev_warn_ratelimited(&ctx->i2c_client->dev,
+			"%s key ring full, dropped %d events\n",
+			__func__, ctx->key_fifo_count - queued);
+	}
+	ctx->key_fifo_count = 0;
+
+	// Update high-water mark
+	len = kfifo_len(&ctx->key_ring);
+	if (len > ctx->key_ring_high_water) {
+		ctx->key_ring_high_water = len;
+	}
+}
+
+// Record time from IRQ thread entry to input_sync for the given path
+static void update_report_latency(struct kbd_ctx* ctx, enum report_path path,
+	uint64_t pending_since)
+{
+	uint64_t latency_ns;
+	struct report_latency *latency;
+
+	if (pending_since == 0) {
+		return;
+	}
+
+	latency_ns = ktime_get_ns() - pending_since;
+	latency = &ctx->report_latency[path];
+
+	latency->count++;
+	latency->total_ns += latency_ns;
+	if ((latency->min_ns == 0) || (latency_ns < latency->min_ns)) {
+		latency->min_ns = latency_ns;
+	}
+	if (latency_ns > latency->max_ns) {
+		latency->max_ns = latency_ns;
+	}
+}
+
+// Use time events were read instead of the time of input_sync
+static void set_event_timestamp(struct kbd_ctx* ctx, ktime_t at)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0))
+	input_set_timestamp(ctx->input_dev, at);
+#endif
+}
+
+// Report queued key and touch events, then clear client interrupt flag
+// Called from either the IRQ thread or the worker
+static void report_pending_events(struct kbd_ctx* ctx, enum report_path path)
+{
+	struct key_ring_item item;
+	DECLARE_BITMAP(seen, NUM_SCANCODES);
+	int recover;
+	int rc;
+
+	trace_beepy_kbd_report_start(path, kfifo_len(&ctx->key_ring));
+
+	mutex_lock(&ctx->report_lock);
+
+	// Overflow was detected when these events were read
+	recover = atomic_xchg(&ctx->overflow_pending, 0);
+	bitmap_zero(seen, NUM_SCANCODES);
+
+	// Process queued key events, each in its own frame with its own time
+	while (kfifo_get(&ctx->key_ring, &item)) {
+		set_event_timestamp(ctx, item.at);
+		key_report_event(ctx, &item.ev, 0);
+		input_sync(ctx->input_dev);
+		if (item.ev.state != KEY_STATE_RELEASED) {
+			__set_bit(item.ev.scancode, seen);
+		}
+	}
+
+	// Release keys whose release events were lost
+	if (recover) {
+		recover_key_state(ctx, seen);
+		input_sync(ctx->input_dev);
+	}
+
+	// Handle any pending touch events.
+	// Touch state is written by the read path under read lock
+	mutex_lock(&ctx->read_lock);
+	if (ctx->raised_touch_event) {
+		atomic_long_inc(&ctx->stats.touch_events);
+		set_event_timestamp(ctx, ctx->touch_at);
+		input_touch_report_event(ctx);
+		ctx->raised_touch_event = 0;
+	}
+	mutex_unlock(&ctx->read_lock);
+
+	// Synchronize input system
+	input_sync(ctx->input_dev);
+	trace_beepy_kbd_sync(path);
+	update_report_latency(ctx, path, atomic64_xchg(&ctx->pending_since, 0));
+
+	mutex_unlock(&ctx->report_lock);
+
+	// Clear client interrupt flag if one was raised
+	if (atomic_xchg(&ctx->int_pending, 0)) {
+		rc = kbd_write_i2c_u8(ctx->i2c_client, REG_INT, 0);
+		trace_beepy_kbd_int_ack(rc);
+	}
+}
+
+// Queue events to be reported by input worker
+static void queue_report_work(struct kbd_ctx* ctx)
+{
+	atomic64_cmpxchg(&ctx->report_queued_at, 0, ktime_get_ns());
+	kthread_queue_work(ctx->worker, &ctx->report_work);
+}
+
+// Read interrupt status and queue key and touch events, timestamped `at`
+// Returns interrupt type, or negative error
+static int __read_client_events(struct kbd_ctx* ctx, ktime_t at)
+{
+	int rc, i;
 	uint8_t irq_type;
 	int8_t reg_value;
 
-	// `param` is current keyboard context as started in _probe
-	ctx = (struct kbd_ctx *)param;
-
-	dev_info_ld(&ctx->i2c_client->dev,
-		"%s Interrupt Fired. IRQ: %d\n", __func__, irq);
+	// Read interrupt type
+	if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_INT, &irq_type))) {
+		return rc;
+	}
+	trace_beepy_kbd_int_status(irq_type);
 
-	// Read interrupt type from client
-	if (kbd_read_i2c_u8(ctx->i2c_client, REG_INT, &irq_type)) {
-		return IRQ_NONE;
+	// Bus recovered after an error, restore configuration if firmware reset
+	if (atomic_xchg(&ctx->shadow.check_reset, 0)) {
+		input_fw_check_reset(ctx);
 	}
 	dev_info_ld(&ctx->i2c_client->dev,
 		"%s Interrupt type: 0x%02x\n", __func__, irq_type);
 
 	// Reported no interrupt type
 	if (irq_type == 0x00) {
-		return IRQ_NONE;
+		return 0;
 	}
+	atomic_set(&ctx->int_pending, 1);
 
 	// Client reported a key overflow
 	if (irq_type & REG_INT_OVERFLOW) {
+		atomic_long_inc(&ctx->stats.overflows);
 		dev_warn(&ctx->i2c_client->dev, "%s overflow occurred.\n", __func__);
-	}
+
+		// Drain FIFO, reporting will resynchronize key state
+		for (i = 0; i < BBQX0KBD_OVERFLOW_DRAIN_READS; i++) {
+			input_fw_read_fifo(ctx);
+			if (ctx->key_fifo_count == 0) {
+				break;
+			}
+			queue_fifo_items(ctx, at);
+		}
+		atomic_set(&ctx->overflow_pending, 1);
 
 	// Client reported a key event
-	if (irq_type & REG_INT_KEY) {
+	} else if (irq_type & REG_INT_KEY) {
 		input_fw_read_fifo(ctx);
-		schedule_work(&ctx->work_struct);
+		queue_fifo_items(ctx, at);
 	}
 
 	// Client reported a touch event
 	if (irq_type & REG_INT_TOUCH) {
 
 		// Read touch X-coordinate
-		if (kbd_read_i2c_u8(ctx->i2c_client, REG_TOX, &reg_value)) {
-			return IRQ_NONE;
+		if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_TOX, &reg_value))) {
+			return rc;
 		}
 		ctx->touch.dx += reg_value;
 
 		// Read touch Y-coordinate
-		if (kbd_read_i2c_u8(ctx->i2c_client, REG_TOY, &reg_value)) {
-			return IRQ_NONE;
+		if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_TOY, &reg_value))) {
+			return rc;
 		}
 		ctx->touch.dy += reg_value;
 
-		// Set touch event flag and schedule touch work
+		// Set touch event flag, cleared once the event is reported
 		ctx->raised_touch_event = 1;
-		schedule_work(&ctx->work_struct);
+		ctx->touch_at = at;
+	}
 
-	} else {
+	return irq_type;
+}
 
-		// Clear touch event flag
-		ctx->raised_touch_event = 0;
+static int read_client_events(struct kbd_ctx* ctx, ktime_t at)
+{
+	int rc;
+
+	mutex_lock(&ctx->read_lock);
+	rc = __read_client_events(ctx, at);
+	mutex_unlock(&ctx->read_lock);
+
+	return rc;
+}
+
+// Firmware does not update REG_INT while its interrupts are masked,
+// so check key count and touch movement directly
+// Returns event types as interrupt flags, or negative error
+static int poll_client_events(struct kbd_ctx* ctx)
+{
+	int rc;
+	int8_t dx, dy;
+	uint8_t have_touch;
+	ktime_t at;
+
+	rc = 0;
+	mutex_lock(&ctx->read_lock);
+	at = ktime_get();
+
+	// Bus recovered after an error, restore configuration if firmware reset
+	if (atomic_xchg(&ctx->shadow.check_reset, 0)) {
+		input_fw_check_reset(ctx);
+	}
+
+	// Read key count and FIFO items, then touch movement
+	input_fw_read_fifo(ctx);
+	have_touch = ctx->touch.enabled
+		&& !kbd_read_i2c_u8(ctx->i2c_client, REG_TOX, &dx)
+		&& !kbd_read_i2c_u8(ctx->i2c_client, REG_TOY, &dy);
+
+	// Queue FIFO items
+	if (ctx->key_fifo_count) {
+		queue_fifo_items(ctx, at);
+		rc |= REG_INT_KEY;
+	}
+
+	// Add touch movement
+	if (have_touch && (dx || dy)) {
+		ctx->touch.dx += dx;
+		ctx->touch.dy += dy;
+		ctx->raised_touch_event = 1;
+		ctx->touch_at = at;
+		rc |= REG_INT_TOUCH;
+	}
+
+	mutex_unlock(&ctx->read_lock);
+
+	return rc;
+}
+
+// Switch from interrupts to polling until events stop arriving
+static void start_hybrid_polling(struct kbd_ctx* ctx)
+{
+	mutex_lock(&ctx->hybrid_lock);
+
+	// Mode may have changed, or a poll may have started since the interrupt.
+	// While suspended, key interrupts must stay unmasked to wake the system
+	if ((ctx->input_mode != INPUT_MODE_HYBRID) || ctx->hybrid_polling
+	 || ctx->hybrid_suspended) {
+		mutex_unlock(&ctx->hybrid_lock);
+		return;
+	}
+
+	ctx->hybrid_polling = 1;
+	ctx->hybrid_last_event_at = ktime_get();
+	ctx->hybrid_entries++;
+
+	// Mask key and touch interrupts in firmware while polling
+	(void)input_fw_mask_interrupts(ctx);
+
+	hrtimer_start(&ctx->poll_timer, ms_to_ktime(BBQX0KBD_POLL_MIN_PERIOD),
+		HRTIMER_MODE_REL);
+
+	mutex_unlock(&ctx->hybrid_lock);
+}
+
+// Cancel poll timer and return to interrupts if polling a hybrid mode burst
+static void stop_hybrid_polling(struct kbd_ctx* ctx)
+{
+	mutex_lock(&ctx->hybrid_lock);
+
+	hrtimer_cancel(&ctx->poll_timer);
+	if (ctx->hybrid_polling) {
+		ctx->hybrid_polling = 0;
+		(void)input_fw_unmask_interrupts(ctx);
+	}
+
+	mutex_unlock(&ctx->hybrid_lock);
+}
+
+// Poll for events while interrupts are masked, and unmask
+// interrupts once the quiet window has passed without events
+static void run_hybrid_poll(struct kbd_ctx* ctx)
+{
+	int event_types;
+
+	// Read and report events from client
+	ctx->hybrid_polls++;
+	if ((event_types = poll_client_events(ctx)) > 0) {
+		ctx->hybrid_last_event_at = ktime_get();
+
+		// Each poll that found events replaced an interrupt
+		ctx->hybrid_irqs_saved++;
+		report_pending_events(ctx, REPORT_PATH_POLL);
+	}
+
+	mutex_lock(&ctx->hybrid_lock);
+
+	// Polling was stopped by a mode change
+	if (!ctx->hybrid_polling) {
+		mutex_unlock(&ctx->hybrid_lock);
+		return;
+	}
+
+	// Keep polling until quiet window passes
+	if (ktime_ms_delta(ktime_get(), ctx->hybrid_last_event_at)
+		< ctx->hybrid_quiet_ms) {
+		hrtimer_start(&ctx->poll_timer,
+			ms_to_ktime(BBQX0KBD_POLL_MIN_PERIOD), HRTIMER_MODE_REL);
+		mutex_unlock(&ctx->hybrid_lock);
+		return;
+	}
+
+	// Return to interrupts. An interrupt arriving now waits for the lock,
+	// then starts a new poll with interrupts masked again
+	ctx->hybrid_polling = 0;
+	(void)input_fw_unmask_interrupts(ctx);
+
+	mutex_unlock(&ctx->hybrid_lock);
+
+	// Report events that arrived before interrupts were unmasked
+	if (poll_client_events(ctx) > 0) {
+		report_pending_events(ctx, REPORT_PATH_POLL);
+	}
+}
+
+// Hard IRQ handler, record edge time before waking IRQ thread
+static irqreturn_t input_irq_edge_handler(int irq, void *param)
+{
+	struct kbd_ctx *ctx;
+
+	ctx = (struct kbd_ctx *)param;
+	atomic64_set(&ctx->irq_edge_at, ktime_to_ns(ktime_get()));
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t input_irq_handler(int irq, void *param)
+{
+	struct kbd_ctx *ctx;
+	int irq_type;
+	ktime_t at;
+
+	// `param` is current keyboard context as started in _probe
+	ctx = (struct kbd_ctx *)param;
+
+	// Events were ready at the interrupt edge. Consume the edge time
+	// so that later passes do not reuse it
+	at = ns_to_ktime(atomic64_xchg(&ctx->irq_edge_at, 0));
+	if (at == 0) {
+		at = ktime_get();
+	}
+
+	trace_beepy_kbd_irq(irq);
+	atomic_long_inc(&ctx->stats.irqs);
+	dev_info_ld(&ctx->i2c_client->dev,
+		"%s Interrupt Fired. IRQ: %d\n", __func__, irq);
+
+	// Keep the earliest unreported interrupt time for latency tracking
+	atomic64_cmpxchg(&ctx->pending_since, 0, ktime_get_ns());
+
+	// Read and queue events from client
+	if ((irq_type = read_client_events(ctx, at)) <= 0) {
+		atomic_long_inc(&ctx->stats.irqs_none);
+		return IRQ_NONE;
+	}
+
+	// Report directly from IRQ thread, or schedule work.
+	// Overflow alone still drained the FIFO and needs key state recovery
+	if (irq_type & (REG_INT_KEY | REG_INT_TOUCH | REG_INT_OVERFLOW)) {
+		if (ctx->report_in_irq) {
+			report_pending_events(ctx, REPORT_PATH_IRQ);
+		} else {
+			queue_report_work(ctx);
+		}
+
+		// In hybrid mode, poll for the rest of this burst
+		if (ctx->input_mode == INPUT_MODE_HYBRID) {
+			start_hybrid_polling(ctx);
+		}
 	}
 
 	return IRQ_HANDLED;
 }
 
-static void input_workqueue_handler(struct work_struct *work_struct_ptr)
+static void input_report_work_handler(struct kthread_work *work)
 {
 	struct kbd_ctx *ctx;
-	uint8_t fifo_idx;
+	uint64_t queued_at;
+	struct report_latency *delay;
 
 	// Get keyboard context from work struct
-	ctx = container_of(work_struct_ptr, struct kbd_ctx, work_struct);
+	ctx = container_of(work, struct kbd_ctx, report_work);
+
+	// Track time spent waiting for the worker to run.
+	// Statistics are read and reset through debugfs under report lock
+	if ((queued_at = atomic64_xchg(&ctx->report_queued_at, 0))) {
+		queued_at = ktime_get_ns() - queued_at;
+		delay = &ctx->worker_queue_delay;
 
-	// Process FIFO items
-	for (fifo_idx = 0; fifo_idx < ctx->key_fifo_count; fifo_idx++) {
-		key_report_event(ctx, &ctx->key_fifo_data[fifo_idx]);
+		mutex_lock(&ctx->report_lock);
+		delay->count++;
+		delay->total_ns += queued_at;
+		if ((delay->min_ns == 0) || (queued_at < delay->min_ns)) {
+			delay->min_ns = queued_at;
+		}
+		if (queued_at > delay->max_ns) {
+			delay->max_ns = queued_at;
+		}
+		mutex_unlock(&ctx->report_lock);
 	}
 
-	// Reset pending FIFO count
-	ctx->key_fifo_count = 0;
+	report_pending_events(ctx, REPORT_PATH_WORKER);
+}
 
-	// Handle any pending touch events
-	if (ctx->raised_touch_event) {
-		input_touch_report_event(ctx);
-		ctx->raised_touch_event = 0;
+void input_set_report_in_irq(struct kbd_ctx* ctx, uint8_t report_in_irq)
+{
+	ctx->report_in_irq = report_in_irq;
+
+	// Finish any work queued under the previous setting
+	if (report_in_irq) {
+		kthread_flush_work(&ctx->report_work);
 	}
+}
 
-	// Synchronize input system and clear client interrupt flag
-	input_sync(ctx->input_dev);
-	if (kbd_write_i2c_u8(ctx->i2c_client, REG_INT, 0)) {
+// Poll timer expired, schedule poll work to run I2C transfers
+static enum hrtimer_restart input_poll_timer_handler(struct hrtimer *timer)
+{
+	struct kbd_ctx *ctx;
+
+	ctx = container_of(timer, struct kbd_ctx, poll_timer);
+	kthread_queue_work(ctx->worker, &ctx->poll_work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void input_poll_work_handler(struct kthread_work *work)
+{
+	struct kbd_ctx *ctx;
+	int irq_type;
+	uint8_t hybrid_polling;
+
+	// Get keyboard context from work struct
+	ctx = container_of(work, struct kbd_ctx, poll_work);
+
+	// Polling during a hybrid mode burst
+	mutex_lock(&ctx->hybrid_lock);
+	hybrid_polling = ctx->hybrid_polling;
+	mutex_unlock(&ctx->hybrid_lock);
+	if (hybrid_polling) {
+		run_hybrid_poll(ctx);
+		return;
+	}
+
+	// Read and report events from client
+	atomic64_cmpxchg(&ctx->pending_since, 0, ktime_get_ns());
+	irq_type = read_client_events(ctx, ktime_get());
+	if ((irq_type > 0)
+	 && (irq_type & (REG_INT_KEY | REG_INT_TOUCH | REG_INT_OVERFLOW))) {
+		report_pending_events(ctx, REPORT_PATH_POLL);
+	}
+
+	// Not polling, this was a single pass after switching modes
+	if (ctx->input_mode != INPUT_MODE_POLL) {
 		return;
 	}
+
+	// Poll quickly while events arrive, back off exponentially when idle
+	if (irq_type > 0) {
+		ctx->poll_period_ms = BBQX0KBD_POLL_MIN_PERIOD;
+	} else if (ctx->poll_period_ms < BBQX0KBD_POLL_PERIOD) {
+		ctx->poll_period_ms = min(ctx->poll_period_ms * 2,
+			(unsigned int)BBQX0KBD_POLL_PERIOD);
+	}
+
+	hrtimer_start(&ctx->poll_timer, ms_to_ktime(ctx->poll_period_ms),
+		HRTIMER_MODE_REL);
+}
+
+// Stop poll timer and wait for any running poll work
+static void stop_polling(struct kbd_ctx* ctx)
+{
+	hrtimer_cancel(&ctx->poll_timer);
+	kthread_cancel_work_sync(&ctx->poll_work);
+	hrtimer_cancel(&ctx->poll_timer);
+}
+
+int input_set_mode(struct kbd_ctx* ctx, uint8_t input_mode)
+{
+	// Polling is the only option without an IRQ line
+	if ((input_mode != INPUT_MODE_POLL) && (ctx->irq <= 0)) {
+		return -EINVAL;
+	}
+
+	if (input_mode == ctx->input_mode) {
+		return 0;
+	}
+
+	// Stop polling from previous mode. Interrupts see the new mode
+	// once hybrid polling is stopped, and do not start it again
+	ctx->input_mode = input_mode;
+	stop_hybrid_polling(ctx);
+	stop_polling(ctx);
+
+	if (input_mode == INPUT_MODE_POLL) {
+
+		// Mask IRQ and start polling
+		if (ctx->irq_enabled) {
+			disable_irq(ctx->irq);
+			ctx->irq_enabled = 0;
+		}
+		ctx->poll_period_ms = BBQX0KBD_POLL_MIN_PERIOD;
+		kthread_queue_work(ctx->worker, &ctx->poll_work);
+
+	} else {
+
+		// Unmask IRQ
+		if (!ctx->irq_enabled) {
+			enable_irq(ctx->irq);
+			ctx->irq_enabled = 1;
+		}
+
+		// An edge may have been missed while polling,
+		// so service the client once to clear its interrupt flag
+		kthread_queue_work(ctx->worker, &ctx->poll_work);
+	}
+
+	return 0;
+}
+
+void input_set_hybrid_quiet_ms(struct kbd_ctx* ctx, unsigned int quiet_ms)
+{
+	ctx->hybrid_quiet_ms = quiet_ms;
+}
+
+int input_set_worker_sched(struct kbd_ctx* ctx, uint8_t worker_sched)
+{
+	switch (worker_sched) {
+
+	// Highest normal priority, same as a WQ_HIGHPRI workqueue
+	case WORKER_SCHED_NORMAL:
+		sched_set_normal(ctx->worker->task, MIN_NICE);
+		break;
+
+	// Realtime, below threaded IRQ handlers
+	case WORKER_SCHED_FIFO_LOW:
+		sched_set_fifo_low(ctx->worker->task);
+		break;
+
+	// Realtime, same as threaded IRQ handlers
+	case WORKER_SCHED_FIFO:
+		sched_set_fifo(ctx->worker->task);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	ctx->worker_sched = worker_sched;
+
+	return 0;
+}
+
+int input_set_worker_cpus(struct kbd_ctx* ctx, struct cpumask const* cpus)
+{
+	// Empty mask allows all CPUs
+	if (cpumask_empty(cpus)) {
+		cpus = cpu_possible_mask;
+	}
+
+	return set_cpus_allowed_ptr(ctx->worker->task, cpus);
+}
+
+static void destroy_worker(void *worker)
+{
+	kthread_destroy_worker((struct kthread_worker *)worker);
 }
 
 int input_probe(struct i2c_client* i2c_client)
@@ -209,7 +835,25 @@ int input_probe(struct i2c_client* i2c_client)
 
 	// Initialize keyboard context
 	g_ctx->i2c_client = i2c_client;
+	i2c_set_clientdata(i2c_client, g_ctx);
+	if ((rc = kbd_regmap_init(i2c_client, g_ctx))) {
+		return rc;
+	}
 	g_ctx->last_keypress_at = ktime_get_boottime_ns();
+	INIT_KFIFO(g_ctx->key_ring);
+	mutex_init(&g_ctx->report_lock);
+	mutex_init(&g_ctx->read_lock);
+	mutex_init(&g_ctx->hybrid_lock);
+	g_ctx->hybrid_suspended = 0;
+	atomic_set(&g_ctx->int_pending, 0);
+	atomic_set(&g_ctx->overflow_pending, 0);
+	mutex_init(&g_ctx->shadow.lock);
+	atomic_set(&g_ctx->shadow.check_reset, 0);
+	atomic64_set(&g_ctx->irq_edge_at, 0);
+	g_ctx->last_batch_at = ktime_get();
+	bitmap_zero(g_ctx->pressed_scancodes, NUM_SCANCODES);
+	g_ctx->hybrid_quiet_ms = BBQX0KBD_HYBRID_QUIET_PERIOD;
+	atomic64_set(&g_ctx->pending_since, 0);
 
 	// Run subsystem probes
 	if ((rc = input_fw_probe(i2c_client, g_ctx))) {
@@ -236,6 +880,22 @@ int input_probe(struct i2c_client* i2c_client)
 		dev_err(&i2c_client->dev, "beepy-kbd: input_meta_probe failed\n");
 		return rc;
 	}
+	if ((rc = input_fw_update_probe(i2c_client, g_ctx))) {
+		dev_err(&i2c_client->dev, "beepy-kbd: input_fw_update_probe failed\n");
+		return rc;
+	}
+	if ((rc = input_leds_probe(i2c_client, g_ctx))) {
+		dev_err(&i2c_client->dev, "beepy-kbd: input_leds_probe failed\n");
+		return rc;
+	}
+	if ((rc = input_battery_probe(i2c_client, g_ctx))) {
+		dev_err(&i2c_client->dev, "beepy-kbd: input_battery_probe failed\n");
+		return rc;
+	}
+	if ((rc = input_idle_probe(i2c_client, g_ctx))) {
+		dev_err(&i2c_client->dev, "beepy-kbd: input_idle_probe failed\n");
+		return rc;
+	}
 
 	// Allocate input device
 	if ((g_ctx->input_dev = devm_input_allocate_device(&i2c_client->dev)) == NULL) {
@@ -271,16 +931,61 @@ int input_probe(struct i2c_client* i2c_client)
 	input_set_capability(g_ctx->input_dev, EV_KEY, BTN_LEFT);
 	input_set_capability(g_ctx->input_dev, EV_KEY, BTN_RIGHT);
 
-	// Request IRQ handler for I2C client and initialize workqueue
-	if ((rc = devm_request_threaded_irq(&i2c_client->dev,
-		i2c_client->irq, NULL, input_irq_handler, IRQF_SHARED | IRQF_ONESHOT,
-		i2c_client->name, g_ctx))) {
-
+	// Create input worker, destroyed with device
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	g_ctx->worker = kthread_create_worker(0, "beepy-kbd");
+#else
+	g_ctx->worker = kthread_run_worker(0, "beepy-kbd");
+#endif
+	if (IS_ERR(g_ctx->worker)) {
 		dev_err(&i2c_client->dev,
-			"Could not claim IRQ %d; error %d\n", i2c_client->irq, rc);
+			"%s Could not create input worker\n", __func__);
+		return PTR_ERR(g_ctx->worker);
+	}
+	if ((rc = devm_add_action_or_reset(&i2c_client->dev,
+		destroy_worker, g_ctx->worker))) {
 		return rc;
 	}
-	INIT_WORK(&g_ctx->work_struct, input_workqueue_handler);
+	g_ctx->worker_sched = WORKER_SCHED_NORMAL;
+	sched_set_normal(g_ctx->worker->task, MIN_NICE);
+	atomic64_set(&g_ctx->report_queued_at, 0);
+
+	// Initialize worker items and poll timer
+	kthread_init_work(&g_ctx->report_work, input_report_work_handler);
+	kthread_init_work(&g_ctx->poll_work, input_poll_work_handler);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0)
+	hrtimer_init(&g_ctx->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	g_ctx->poll_timer.function = input_poll_timer_handler;
+#else
+	hrtimer_setup(&g_ctx->poll_timer, input_poll_timer_handler,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+
+	// Request IRQ handler for I2C client
+	g_ctx->irq = i2c_client->irq;
+	if (g_ctx->irq > 0) {
+		if ((rc = devm_request_threaded_irq(&i2c_client->dev,
+			g_ctx->irq, input_irq_edge_handler, input_irq_handler,
+			IRQF_SHARED | IRQF_ONESHOT,
+			i2c_client->name, g_ctx))) {
+
+			dev_err(&i2c_client->dev,
+				"Could not claim IRQ %d; error %d\n", g_ctx->irq, rc);
+			return rc;
+		}
+		g_ctx->irq_enabled = 1;
+		g_ctx->input_mode = INPUT_MODE_IRQ;
+
+		// Keypress can wake system from suspend
+		device_init_wakeup(&i2c_client->dev, true);
+
+	// No IRQ line, fall back to polling
+	} else {
+		dev_warn(&i2c_client->dev,
+			"%s No IRQ assigned, polling for input\n", __func__);
+		g_ctx->irq_enabled = 0;
+		g_ctx->input_mode = INPUT_MODE_IRQ;
+	}
 
 	// Register input device with input subsystem
 	dev_info(&i2c_client->dev,
@@ -291,12 +996,120 @@ int input_probe(struct i2c_client* i2c_client)
 		return rc;
 	}
 
+	// Start polling once input device can receive events
+	if (g_ctx->irq <= 0) {
+		(void)input_set_mode(g_ctx, INPUT_MODE_POLL);
+	}
+
+	return 0;
+}
+
+int input_suspend(struct i2c_client* i2c_client)
+{
+	struct kbd_ctx* ctx;
+	struct fw_update_progress progress;
+
+	ctx = i2c_get_clientdata(i2c_client);
+
+	// Suspending would interrupt a firmware update
+	input_fw_update_get_progress(&progress);
+	if (progress.running) {
+		return -EBUSY;
+	}
+
+	// Stop polling and finish pending reports. Interrupts stay unmasked
+	// in firmware so that a keypress raises the interrupt line
+	mutex_lock(&ctx->hybrid_lock);
+	ctx->hybrid_suspended = 1;
+	mutex_unlock(&ctx->hybrid_lock);
+	stop_hybrid_polling(ctx);
+	stop_polling(ctx);
+	kthread_flush_work(&ctx->report_work);
+
+	// Stop periodic I2C transfers
+	input_battery_suspend(ctx);
+
+	// Touchpad movement should not wake the system
+	if (ctx->touch.enabled) {
+		(void)input_fw_disable_touch_interrupts(ctx);
+	}
+	input_fw_suspend(ctx);
+
+	// Keypress wakes the system
+	if ((ctx->irq > 0) && device_may_wakeup(&i2c_client->dev)) {
+
+		// IRQ is masked in poll mode
+		if (!ctx->irq_enabled) {
+			enable_irq(ctx->irq);
+			ctx->irq_enabled = 1;
+			ctx->irq_enabled_for_wake = 1;
+		}
+
+		ctx->irq_wake = !enable_irq_wake(ctx->irq);
+	}
+
+	return 0;
+}
+
+int input_resume(struct i2c_client* i2c_client)
+{
+	struct kbd_ctx* ctx;
+
+	ctx = i2c_get_clientdata(i2c_client);
+
+	if (ctx->irq_wake) {
+		disable_irq_wake(ctx->irq);
+		ctx->irq_wake = 0;
+	}
+	if (ctx->irq_enabled_for_wake) {
+		disable_irq(ctx->irq);
+		ctx->irq_enabled = 0;
+		ctx->irq_enabled_for_wake = 0;
+	}
+
+	// Restore configuration if firmware reset while suspended
+	input_fw_check_reset(ctx);
+	if (ctx->touch.enabled) {
+		(void)input_fw_enable_touch_interrupts(ctx);
+	}
+	input_fw_resume(ctx);
+
+	// Time passed while suspended
+	(void)input_rtc_resync(ctx);
+	input_battery_resume(ctx);
+
+	mutex_lock(&ctx->hybrid_lock);
+	ctx->hybrid_suspended = 0;
+	mutex_unlock(&ctx->hybrid_lock);
+
+	// Drain FIFO, including the key that woke the system.
+	// In poll mode, this also restarts polling
+	ctx->poll_period_ms = BBQX0KBD_POLL_MIN_PERIOD;
+	kthread_queue_work(ctx->worker, &ctx->poll_work);
+
 	return 0;
 }
 
 void input_shutdown(struct i2c_client* i2c_client)
 {
+	// Mask IRQ so that a keypress cannot queue work or run the IRQ thread
+	// after subsystems are shut down. Waits for a running IRQ thread
+	if ((g_ctx->irq > 0) && g_ctx->irq_enabled) {
+		disable_irq(g_ctx->irq);
+		g_ctx->irq_enabled = 0;
+	}
+
+	// Stop polling and pending work
+	g_ctx->input_mode = INPUT_MODE_IRQ;
+	stop_hybrid_polling(g_ctx);
+	stop_polling(g_ctx);
+	kthread_cancel_work_sync(&g_ctx->report_work);
+
 	// Run subsystem shutdowns
+	input_idle_shutdown(i2c_client, g_ctx);
+	input_battery_shutdown(i2c_client, g_ctx);
+	input_leds_shutdown(i2c_client, g_ctx);
+	input_fw_update_shutdown(i2c_client, g_ctx);
 	input_meta_shutdown(i2c_client, g_ctx);
 	input_touch_shutdown(i2c_client, g_ctx);
 	input_modifiers_shutdown(i2c_client, g_ctx);
@@ -9,6 +9,13 @@
 #include <linux/types.h>
 #include <linux/interrupt.h>
 #include <linux/i2c.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/regmap.h>
+#include <linux/workqueue.h>
 
 #include "registers.h"
 
@@ -17,6 +24,12 @@
 #define BBQX0KBD_PRODUCT_ID		0x0001
 #define BBQX0KBD_VERSION_ID		0x0001
 
+// Key events queued between IRQ thread and worker, must be a power of two
+#define KEY_RING_SIZE			128
+
+// Scancodes are one byte
+#define NUM_SCANCODES			256
+
 // From keyboard firmware source
 enum rp2040_key_state
 {
@@ -34,6 +47,28 @@ struct key_fifo_item
 	enum rp2040_key_state state : 4;
 };
 
+// Key event with the time it was read from the client
+struct key_ring_item
+{
+	struct key_fifo_item ev;
+	ktime_t at;
+};
+
+// Touchpad LED power is lowered while touch input is off
+struct touch_power
+{
+	struct mutex lock;
+	struct delayed_work gate_work;
+	uint8_t gated;
+
+	// Transitions and time spent in each state
+	uint32_t gates;
+	uint32_t ungates;
+	uint64_t state_since;
+	uint64_t active_ns;
+	uint64_t gated_ns;
+};
+
 struct touch_ctx
 {
 	enum {
@@ -51,26 +86,233 @@ struct touch_ctx
 	uint8_t entry_while_shift_held;
 	uint8_t threshold;
 	int x, dx, y, dy;
+
+	// Configured touchpad LED power, and whether it is lowered while idle.
+	// Protected by touch power lock
+	uint8_t led_setting;
+	uint8_t led_dimmed;
+	struct touch_power power;
+};
+
+// Sticky modifier state bits
+#define MODIFIER_SHIFT		(1 << 0)
+#define MODIFIER_CTRL		(1 << 1)
+#define MODIFIER_PHYS_ALT	(1 << 2)
+#define MODIFIER_ALT		(1 << 3)
+#define MODIFIER_SYM		(1 << 4)
+
+// Firmware RGB LED setting
+struct kbd_led_rgb
+{
+	uint8_t mode;
+	uint8_t r, g, b;
+};
+
+// Filtered battery level
+struct battery_reading
+{
+	int raw;
+	int voltage_mv;
+	int capacity;
+};
+
+// Firmware RTC value anchored to boot time, so that reads
+// can be answered without I2C transfers
+struct rtc_anchor
+{
+	struct mutex lock;
+	uint8_t valid;
+	time64_t rtc_secs;
+	uint64_t boottime_ns;
+
+	// Drift between anchored and firmware time at each resync
+	uint32_t reads;
+	uint32_t resyncs;
+	int64_t last_drift_secs;
+	int64_t max_drift_secs;
+
+	// Alarm armed as firmware rewake timer at power off
+	time64_t alarm_secs;
+	uint8_t alarm_enabled;
+};
+
+// Firmware update state
+struct fw_update_progress
+{
+	uint8_t running;
+	// Last REG_UPDATE_DATA state read from firmware
+	uint8_t state;
+	// Transfer error, if any
+	int error;
+	size_t bytes_written;
+	// Image size, or bytes written so far if streamed
+	size_t bytes_total;
+	uint64_t started_at;
+};
+
+// Where key events are reported to the input system
+enum report_path
+{
+	REPORT_PATH_WORKER = 0,
+	REPORT_PATH_IRQ = 1,
+	REPORT_PATH_POLL = 2,
+	NUM_REPORT_PATHS
+};
+
+// Which subsystem handled a key event
+enum key_consumer
+{
+	KEY_CONSUMER_NONE = 0,
+	KEY_CONSUMER_POWER = 1,
+	KEY_CONSUMER_FW = 2,
+	KEY_CONSUMER_TOUCH = 3,
+	KEY_CONSUMER_MODIFIERS = 4,
+	KEY_CONSUMER_META = 5,
+	KEY_CONSUMER_PASSTHROUGH = 6,
+	NUM_KEY_CONSUMERS
+};
+
+// How the client is checked for new events
+enum input_mode
+{
+	INPUT_MODE_IRQ = 0,
+	INPUT_MODE_POLL = 1,
+	INPUT_MODE_HYBRID = 2,
+};
+
+// Input worker scheduling policy
+enum worker_sched
+{
+	WORKER_SCHED_NORMAL = 0,
+	WORKER_SCHED_FIFO_LOW = 1,
+	WORKER_SCHED_FIFO = 2,
+};
+
+// Latency statistics in nanoseconds
+struct report_latency
+{
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+};
+
+// Registers are 7 bits, top bit is write flag
+#define NUM_REGS				BBQX0KBD_WRITE_MASK
+
+// Indirect touchpad registers are one byte
+#define NUM_TOUCHPAD_REGS		256
+
+// Write-through copy of indirect touchpad registers owned by the driver.
+// Directly addressed registers are cached by the register map
+struct reg_shadow
+{
+	struct mutex lock;
+	uint8_t touchpad_value[NUM_TOUCHPAD_REGS];
+	DECLARE_BITMAP(touchpad_valid, NUM_TOUCHPAD_REGS);
+
+	// Set on I2C error, firmware may have reset
+	atomic_t check_reset;
+	uint32_t resyncs;
+};
+
+// Runtime statistics, updated with atomics to avoid locking in hot path.
+// New fields must also be reset in debugfs stats_write
+struct kbd_stats
+{
+	atomic_long_t irqs;
+	atomic_long_t irqs_none;
+	atomic_long_t overflows;
+	atomic_long_t overflow_recoveries;
+	atomic_long_t synthesized_releases;
+	atomic_long_t touch_events;
+	atomic_long_t fifo_depth[BBQX0KBD_FIFO_SIZE + 1];
+	atomic_long_t keys[NUM_KEY_CONSUMERS];
+	atomic_long_t i2c_read_errors[NUM_REGS];
+	atomic_long_t i2c_write_errors[NUM_REGS];
 };
 
 struct kbd_ctx
 {
-	struct work_struct work_struct;
+	// Dedicated input worker thread
+	struct kthread_worker *worker;
+	struct kthread_work report_work;
+	uint8_t worker_sched;
+	atomic64_t report_queued_at;
+	struct report_latency worker_queue_delay;
+
 	uint8_t version_number;
 
 	struct i2c_client *i2c_client;
+	struct regmap *regmap;
 	struct input_dev *input_dev;
 
 	// Map from input HID scancodes to Linux keycodes
 	uint8_t *keycode_map;
 
-	// Key state and touch FIFO queue
+	// Firmware FIFO items read by the IRQ thread
 	uint8_t key_fifo_count;
 	struct key_fifo_item key_fifo_data[BBQX0KBD_FIFO_SIZE];
 	uint64_t last_keypress_at;
 
+	// Scancodes last reported as pressed, to recover from FIFO overflow
+	DECLARE_BITMAP(pressed_scancodes, NUM_SCANCODES);
+	atomic_t overflow_pending;
+
+	// Single-producer (IRQ thread), single-consumer (worker) key event ring
+	DECLARE_KFIFO(key_ring, struct key_ring_item, KEY_RING_SIZE);
+	uint32_t key_ring_high_water;
+	uint32_t key_ring_dropped;
+
+	// Interrupt edge time captured by the hard IRQ handler
+	atomic64_t irq_edge_at;
+	// Time of the previous FIFO batch, used to spread batch timestamps
+	ktime_t last_batch_at;
+	// Time of the pending touch event
+	ktime_t touch_at;
+
+	// Report from IRQ thread instead of scheduling work
+	uint8_t report_in_irq;
+	struct mutex report_lock;
+	atomic64_t pending_since;
+	// Time from IRQ thread entry to input_sync
+	struct report_latency report_latency[NUM_REPORT_PATHS];
+
+	// Interrupt or adaptive polling input
+	uint8_t input_mode;
+	int irq;
+	uint8_t irq_enabled;
+	// Interrupt armed to wake system from suspend
+	uint8_t irq_wake;
+	// Interrupt enabled only for wakeup, masked in poll mode
+	uint8_t irq_enabled_for_wake;
+	struct hrtimer poll_timer;
+	struct kthread_work poll_work;
+	unsigned int poll_period_ms;
+	struct mutex read_lock;
+	atomic_t int_pending;
+
+	// Hybrid mode polls with interrupts masked during bursts.
+	// Polling state, firmware interrupt mask, and poll timer
+	// are changed together under hybrid lock
+	struct mutex hybrid_lock;
+	uint8_t hybrid_polling;
+	uint8_t hybrid_suspended;
+	unsigned int hybrid_quiet_ms;
+	ktime_t hybrid_last_event_at;
+	uint32_t hybrid_entries;
+	uint32_t hybrid_polls;
+	uint32_t hybrid_irqs_saved;
+
+	// Pending touch event and movement, protected by read lock
 	uint8_t raised_touch_event;
 	struct touch_ctx touch;
+
+	struct rtc_anchor rtc;
+
+	struct reg_shadow shadow;
+
+	struct kbd_stats stats;
 };
 
 // Shared global state for global interfaces such as sysfs
@@ -80,6 +322,14 @@ extern struct kbd_ctx *g_ctx;
 
 int input_probe(struct i2c_client* i2c_client);
 void input_shutdown(struct i2c_client* i2c_client);
+int input_suspend(struct i2c_client* i2c_client);
+int input_resume(struct i2c_client* i2c_client);
+
+void input_set_report_in_irq(struct kbd_ctx* ctx, uint8_t report_in_irq);
+int input_set_mode(struct kbd_ctx* ctx, uint8_t input_mode);
+void input_set_hybrid_quiet_ms(struct kbd_ctx* ctx, unsigned int quiet_ms);
+int input_set_worker_sched(struct kbd_ctx* ctx, uint8_t worker_sched);
+int input_set_worker_cpus(struct kbd_ctx* ctx, struct cpumask const* cpus);
 
 // Internal interfaces
 
@@ -94,17 +344,29 @@ int input_fw_consumes_keycode(struct kbd_ctx* ctx,
 void input_fw_decrease_brightness(struct kbd_ctx* ctx);
 void input_fw_increase_brightness(struct kbd_ctx* ctx);
 void input_fw_toggle_brightness(struct kbd_ctx* ctx);
+void input_fw_set_brightness(struct kbd_ctx* ctx, uint8_t brightness);
+void input_fw_fade_brightness(struct kbd_ctx* ctx, uint8_t brightness);
+uint8_t input_fw_get_brightness(void);
+void input_fw_dim_backlight(struct kbd_ctx* ctx, uint8_t dimmed);
 
 int input_fw_enable_touch_interrupts(struct kbd_ctx* ctx);
 int input_fw_disable_touch_interrupts(struct kbd_ctx* ctx);
+int input_fw_mask_interrupts(struct kbd_ctx* ctx);
+int input_fw_unmask_interrupts(struct kbd_ctx* ctx);
 
 void input_fw_read_fifo(struct kbd_ctx* ctx);
 
+int input_fw_resync(struct kbd_ctx* ctx);
+void input_fw_check_reset(struct kbd_ctx* ctx);
+
 int input_fw_get_rtc(uint8_t* year, uint8_t* mon, uint8_t* day,
 	uint8_t* hour, uint8_t* min, uint8_t* sec);
 int input_fw_set_rtc(uint8_t year, uint8_t mon, uint8_t day,
 	uint8_t hour, uint8_t min, uint8_t sec);
 
+void input_fw_suspend(struct kbd_ctx* ctx);
+void input_fw_resume(struct kbd_ctx* ctx);
+
 void input_fw_set_handle_poweroff(struct kbd_ctx* ctx, uint8_t handle_poweroff);
 void input_fw_set_auto_off(struct kbd_ctx* ctx, uint8_t auto_off);
 
@@ -113,6 +375,8 @@ void input_fw_set_auto_off(struct kbd_ctx* ctx, uint8_t auto_off);
 int input_rtc_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
 void input_rtc_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
 
+int input_rtc_resync(struct kbd_ctx* ctx);
+
 // Display
 
 int input_display_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
@@ -136,18 +400,63 @@ int input_modifiers_consumes_keycode(struct kbd_ctx* ctx,
 
 uint8_t input_modifiers_apply_pending(struct kbd_ctx* ctx, uint8_t keycode);
 void input_modifiers_reset(struct kbd_ctx* ctx);
+void input_modifiers_clear(struct kbd_ctx* ctx);
+void input_modifiers_get_state(uint8_t* active, uint8_t* locked);
 
 void input_modifiers_send_control(struct kbd_ctx* ctx);
 void input_modifiers_send_alt(struct kbd_ctx* ctx);
 
 void input_modifiers_reset_shift(struct kbd_ctx* ctx);
 
+// Battery
+
+int input_battery_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+void input_battery_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+
+int input_battery_get(struct battery_reading* reading);
+void input_battery_set_period_ms(struct kbd_ctx* ctx, unsigned int period_ms);
+void input_battery_suspend(struct kbd_ctx* ctx);
+void input_battery_resume(struct kbd_ctx* ctx);
+
+// Idle
+
+int input_idle_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+void input_idle_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+
+void input_idle_activity(struct kbd_ctx* ctx);
+uint8_t input_idle_is_idle(void);
+void input_idle_set_timeout_ms(struct kbd_ctx* ctx, unsigned int idle_ms);
+void input_idle_set_dim_ms(struct kbd_ctx* ctx, unsigned int dim_ms);
+void input_idle_set_dim_touch_led(struct kbd_ctx* ctx, uint8_t dim_touch_led);
+
+// LED
+
+int input_leds_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+void input_leds_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+
+int input_leds_set(struct kbd_ctx* ctx, struct kbd_led_rgb const* led);
+int input_leds_set_reg(struct kbd_ctx* ctx, uint8_t reg, uint8_t value);
+void input_leds_get(struct kbd_led_rgb* led);
+void input_leds_resync(struct kbd_ctx* ctx);
+void input_leds_kbd_backlight_changed(uint8_t brightness);
+
+// Firmware update
+
+int input_fw_update_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+void input_fw_update_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
+
+ssize_t input_fw_update_write(struct kbd_ctx* ctx, char const* buf, size_t count);
+int input_fw_update_request(struct kbd_ctx* ctx, char const* name);
+void input_fw_update_get_progress(struct fw_update_progress* progress);
+char const* input_fw_update_error(uint8_t update_state);
+
 // Touch
 
 int input_touch_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
 void input_touch_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
 
 void input_touch_report_event(struct kbd_ctx *ctx);
+void input_touch_resync(struct kbd_ctx* ctx);
 
 int input_touch_consumes_keycode(struct kbd_ctx* ctx,
 	uint8_t *remapped_keycode, uint8_t keycode, uint8_t state);
@@ -159,6 +468,9 @@ void input_touch_set_activation(struct kbd_ctx *ctx, uint8_t activation);
 void input_touch_set_input_as(struct kbd_ctx *ctx, uint8_t input_as);
 
 void input_touch_set_threshold(struct kbd_ctx *ctx, uint8_t threshold);
+int input_touch_set_led(struct kbd_ctx *ctx, uint8_t led_setting);
+void input_touch_dim_led(struct kbd_ctx *ctx, uint8_t dimmed);
+void input_touch_get_power(struct kbd_ctx *ctx, struct touch_power* power);
 void input_touch_set_indicator(struct kbd_ctx *ctx);
 
 // Meta mode
@@ -169,6 +481,7 @@ void input_meta_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx);
 int input_meta_consumes_keycode(struct kbd_ctx* ctx,
 	uint8_t *remapped_keycode, uint8_t keycode, uint8_t state);
 
+uint8_t input_meta_is_enabled(void);
 void input_meta_enable(struct kbd_ctx* ctx);
 void input_meta_disable(struct kbd_ctx* ctx);
 
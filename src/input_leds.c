@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Input LED subsystem
+
+#include <linux/leds.h>
+#include <linux/version.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+#include <linux/led-class-multicolor.h>
+#endif
+
+#include "config.h"
+#include "i2c_helper.h"
+#include "input_iface.h"
+
+// Globals
+
+static struct kbd_ctx* g_leds_ctx;
+
+// Last LED setting written to firmware, protected by LED lock
+static struct mutex g_leds_lock;
+static struct kbd_led_rgb g_led;
+
+// Keyboard backlight
+static struct led_classdev g_kbd_backlight;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+static struct mc_subled g_led_subleds[3];
+static struct led_classdev_mc g_led_mc;
+#endif
+
+// Helpers
+
+// Write LED setting to firmware
+// Called with LED lock held
+static int write_led(struct kbd_ctx* ctx, struct kbd_led_rgb const* led)
+{
+	int rc;
+
+	// Color is only applied when mode is written, skip it when turning off.
+	// Unchanged colors are skipped by the register cache
+	if (led->mode != REG_LED_MODE_OFF) {
+		if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_LED_R, 0xff, led->r))
+		 || (rc = kbd_update_i2c_u8(ctx->i2c_client, REG_LED_G, 0xff, led->g))
+		 || (rc = kbd_update_i2c_u8(ctx->i2c_client, REG_LED_B, 0xff, led->b))) {
+			return rc;
+		}
+	}
+
+	// Apply color setting
+	if ((rc = kbd_write_i2c_u8(ctx->i2c_client, REG_LED, led->mode))) {
+		return rc;
+	}
+
+	g_led = *led;
+
+	return 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+
+// Update multicolor LED class state after a sysfs write
+// Called with LED lock held
+static void sync_led_mc(void)
+{
+	g_led_subleds[0].intensity = g_led.r;
+	g_led_subleds[1].intensity = g_led.g;
+	g_led_subleds[2].intensity = g_led.b;
+	g_led_mc.led_cdev.brightness = (g_led.mode != REG_LED_MODE_OFF)
+		? g_led_mc.led_cdev.max_brightness
+		: LED_OFF;
+}
+
+// Called by LED core, and by its blink timer and triggers
+static int led_mc_brightness_set(struct led_classdev *led_cdev,
+	enum led_brightness brightness)
+{
+	int rc;
+	struct led_classdev_mc *mc_cdev;
+	struct kbd_led_rgb led;
+
+	mc_cdev = lcdev_to_mccdev(led_cdev);
+
+	// Scale channel intensities by brightness
+	if ((rc = led_mc_calc_color_components(mc_cdev, brightness))) {
+		return rc;
+	}
+
+	led.mode = (brightness > 0) ? REG_LED_MODE_ON : REG_LED_MODE_OFF;
+	led.r = mc_cdev->subled_info[0].brightness;
+	led.g = mc_cdev->subled_info[1].brightness;
+	led.b = mc_cdev->subled_info[2].brightness;
+
+	// Class device outlives driver shutdown until device release
+	mutex_lock(&g_leds_lock);
+	rc = (g_leds_ctx) ? write_led(g_leds_ctx, &led) : -ENODEV;
+	mutex_unlock(&g_leds_lock);
+
+	return rc;
+}
+
+static int register_led_mc(struct i2c_client* i2c_client)
+{
+	g_led_subleds[0].color_index = LED_COLOR_ID_RED;
+	g_led_subleds[0].channel = 0;
+	g_led_subleds[1].color_index = LED_COLOR_ID_GREEN;
+	g_led_subleds[1].channel = 1;
+	g_led_subleds[2].color_index = LED_COLOR_ID_BLUE;
+	g_led_subleds[2].channel = 2;
+
+	g_led_mc.subled_info = g_led_subleds;
+	g_led_mc.num_colors = ARRAY_SIZE(g_led_subleds);
+
+	// Blinking and patterns are timed by the LED core and triggers
+	g_led_mc.led_cdev.name = "beepy:multicolor:status";
+	g_led_mc.led_cdev.max_brightness = LED_FULL;
+	g_led_mc.led_cdev.brightness_set_blocking = led_mc_brightness_set;
+
+	mutex_lock(&g_leds_lock);
+	sync_led_mc();
+	mutex_unlock(&g_leds_lock);
+
+	// Unregistered on device release, which stops triggers and blink timer
+	return devm_led_classdev_multicolor_register(&i2c_client->dev, &g_led_mc);
+}
+
+#else
+
+static void sync_led_mc(void) {}
+static int register_led_mc(struct i2c_client* i2c_client) { return -EOPNOTSUPP; }
+
+#endif
+
+// Keyboard backlight class device
+
+// Changes are faded in by timed steps. Writes during a fade retarget it,
+// so only the steps are written to the firmware
+static int kbd_backlight_set(struct led_classdev *led_cdev,
+	enum led_brightness brightness)
+{
+	struct kbd_ctx* ctx;
+
+	mutex_lock(&g_leds_lock);
+	ctx = g_leds_ctx;
+	mutex_unlock(&g_leds_lock);
+
+	// Class device outlives driver shutdown until device release
+	if (!ctx) {
+		return -ENODEV;
+	}
+
+	input_fw_fade_brightness(ctx, (uint8_t)brightness);
+	return 0;
+}
+
+// Brightness set by user, not the idle-dimmed level
+static enum led_brightness kbd_backlight_get(struct led_classdev *led_cdev)
+{
+	return input_fw_get_brightness();
+}
+
+static int register_kbd_backlight(struct i2c_client* i2c_client)
+{
+	int rc;
+
+	// Name recognized by desktop power managers such as upower
+	g_kbd_backlight.name = "platform::kbd_backlight";
+	g_kbd_backlight.max_brightness = 0xff;
+	g_kbd_backlight.brightness = input_fw_get_brightness();
+	g_kbd_backlight.brightness_set_blocking = kbd_backlight_set;
+	g_kbd_backlight.brightness_get = kbd_backlight_get;
+
+	// Brightness keys notify through brightness_hw_changed
+	g_kbd_backlight.flags = LED_BRIGHT_HW_CHANGED;
+
+	// Unregistered on device release. Class device is only set once
+	// registered, and is checked before notifying brightness changes
+	if ((rc = devm_led_classdev_register(&i2c_client->dev, &g_kbd_backlight))) {
+		g_kbd_backlight.dev = NULL;
+		return rc;
+	}
+
+	return 0;
+}
+
+// Public interface
+
+// Brightness changed by Meta brightness keys
+void input_leds_kbd_backlight_changed(uint8_t brightness)
+{
+	mutex_lock(&g_leds_lock);
+	if (g_leds_ctx && g_kbd_backlight.dev) {
+		led_classdev_notify_brightness_hw_changed(&g_kbd_backlight, brightness);
+	}
+	mutex_unlock(&g_leds_lock);
+}
+
+// Set color and mode
+int input_leds_set(struct kbd_ctx* ctx, struct kbd_led_rgb const* led)
+{
+	int rc;
+
+	mutex_lock(&g_leds_lock);
+	if (!(rc = write_led(ctx, led))) {
+		sync_led_mc();
+	}
+	mutex_unlock(&g_leds_lock);
+
+	return rc;
+}
+
+// Set a single LED register, keeping the rest of the setting
+int input_leds_set_reg(struct kbd_ctx* ctx, uint8_t reg, uint8_t value)
+{
+	int rc;
+
+	mutex_lock(&g_leds_lock);
+
+	if ((rc = kbd_write_i2c_u8(ctx->i2c_client, reg, value))) {
+		mutex_unlock(&g_leds_lock);
+		return rc;
+	}
+
+	switch (reg) {
+	case REG_LED: g_led.mode = value; break;
+	case REG_LED_R: g_led.r = value; break;
+	case REG_LED_G: g_led.g = value; break;
+	case REG_LED_B: g_led.b = value; break;
+	}
+	sync_led_mc();
+
+	mutex_unlock(&g_leds_lock);
+
+	return 0;
+}
+
+void input_leds_get(struct kbd_led_rgb* led)
+{
+	mutex_lock(&g_leds_lock);
+	*led = g_led;
+	mutex_unlock(&g_leds_lock);
+}
+
+// Rewrite last LED setting after a firmware reset
+void input_leds_resync(struct kbd_ctx* ctx)
+{
+	struct kbd_led_rgb led;
+
+	mutex_lock(&g_leds_lock);
+
+	// Flash-until-key may have been cleared by a keypress before the reset,
+	// so it is not replayed
+	led = g_led;
+	if (led.mode == REG_LED_MODE_FLASH_UNTIL_KEY) {
+		led.mode = REG_LED_MODE_OFF;
+	}
+	if (!write_led(ctx, &led)) {
+		sync_led_mc();
+	}
+
+	mutex_unlock(&g_leds_lock);
+}
+
+int input_leds_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	int rc;
+
+	g_leds_ctx = ctx;
+	mutex_init(&g_leds_lock);
+
+	// Boot indicator was cleared in firmware probe, keep current color
+	g_led.mode = REG_LED_MODE_OFF;
+	(void)kbd_read_i2c_u8(i2c_client, REG_LED_R, &g_led.r);
+	(void)kbd_read_i2c_u8(i2c_client, REG_LED_G, &g_led.g);
+	(void)kbd_read_i2c_u8(i2c_client, REG_LED_B, &g_led.b);
+
+	// LED class devices are optional, sysfs entries work without them
+	if ((rc = register_led_mc(i2c_client))) {
+		dev_warn(&i2c_client->dev,
+			"%s Multicolor LED class device not available: %d\n",
+			__func__, rc);
+	}
+	if ((rc = register_kbd_backlight(i2c_client))) {
+		dev_warn(&i2c_client->dev,
+			"%s Keyboard backlight LED class device not available: %d\n",
+			__func__, rc);
+	}
+
+	return 0;
+}
+
+void input_leds_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
+{
+	// LED class devices stay registered until device release
+	mutex_lock(&g_leds_lock);
+	g_leds_ctx = NULL;
+	mutex_unlock(&g_leds_lock);
+}
@@ -206,6 +206,11 @@ int input_meta_consumes_keycode(struct kbd_ctx* ctx,
 	return 1;
 }
 
+uint8_t input_meta_is_enabled(void)
+{
+	return g_enabled;
+}
+
 void input_meta_enable(struct kbd_ctx* ctx)
 {
 	g_enabled = 1;
@@ -287,6 +287,60 @@ void input_modifiers_reset(struct kbd_ctx* ctx)
 	reset_sticky_modifier(ctx, &g_sticky_altgr);
 }
 
+// Release modifier and clear all sticky state after events were lost
+static void clear_sticky_modifier(struct kbd_ctx* ctx,
+	struct sticky_modifier* mod)
+{
+	if (mod->held || mod->pending || mod->sticky || mod->locked) {
+		mod->unset_callback(ctx, mod);
+		input_display_clear_indicator(mod->indicator_idx);
+	}
+
+	mod->held = 0;
+	mod->pending = 0;
+	mod->sticky = 0;
+	mod->locked = 0;
+}
+
+void input_modifiers_clear(struct kbd_ctx* ctx)
+{
+	clear_sticky_modifier(ctx, &g_sticky_shift);
+	clear_sticky_modifier(ctx, &g_sticky_ctrl);
+	clear_sticky_modifier(ctx, &g_sticky_phys_alt);
+	clear_sticky_modifier(ctx, &g_sticky_alt);
+	clear_sticky_modifier(ctx, &g_sticky_altgr);
+
+	// Clear symbol menu overlay if it was showing
+	if (g_showing_sym_menu) {
+		input_display_clear_overlays();
+		g_showing_sym_menu = 0;
+	}
+}
+
+// Set modifier bit if modifier is applied or will be applied to the next key
+static void get_sticky_modifier_state(struct sticky_modifier const* mod,
+	uint8_t bit, uint8_t* active, uint8_t* locked)
+{
+	if (mod->held || mod->pending || mod->sticky || mod->locked) {
+		*active |= bit;
+	}
+	if (mod->locked) {
+		*locked |= bit;
+	}
+}
+
+void input_modifiers_get_state(uint8_t* active, uint8_t* locked)
+{
+	*active = 0;
+	*locked = 0;
+
+	get_sticky_modifier_state(&g_sticky_shift, MODIFIER_SHIFT, active, locked);
+	get_sticky_modifier_state(&g_sticky_ctrl, MODIFIER_CTRL, active, locked);
+	get_sticky_modifier_state(&g_sticky_phys_alt, MODIFIER_PHYS_ALT, active, locked);
+	get_sticky_modifier_state(&g_sticky_alt, MODIFIER_ALT, active, locked);
+	get_sticky_modifier_state(&g_sticky_altgr, MODIFIER_SYM, active, locked);
+}
+
 void input_modifiers_send_control(struct kbd_ctx* ctx)
 {
 	transition_sticky_modifier(ctx, &g_sticky_ctrl, KEY_STATE_PRESSED);
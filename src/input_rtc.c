@@ -2,21 +2,109 @@
 // Input RTC subsystem
 
 #include <linux/rtc.h>
+#include <linux/timekeeping.h>
+#include <linux/math64.h>
+#include <linux/reboot.h>
+#include <linux/version.h>
+
+#include "i2c_helper.h"
 
 #include "config.h"
 #include "input_iface.h"
 
+// Anchor firmware time in seconds to the current boot time
+// Called with anchor lock held
+static void set_anchor(struct kbd_ctx* ctx, time64_t rtc_secs)
+{
+	ctx->rtc.rtc_secs = rtc_secs;
+	ctx->rtc.boottime_ns = ktime_get_boottime_ns();
+	ctx->rtc.valid = 1;
+}
+
+// Firmware time predicted from anchor
+// Called with anchor lock held
+static time64_t anchored_secs(struct kbd_ctx* ctx)
+{
+	return ctx->rtc.rtc_secs
+		+ div_u64(ktime_get_boottime_ns() - ctx->rtc.boottime_ns, NSEC_PER_SEC);
+}
+
+// Read firmware RTC and update anchor, recording drift from anchored time
+// Called with anchor lock held
+static int __input_rtc_resync(struct kbd_ctx* ctx)
+{
+	int rc;
+	uint8_t year, mon, mday, hour, min, sec;
+	struct rtc_time tm;
+	time64_t rtc_secs, drift_secs;
+
+	if ((rc = input_fw_get_rtc(&year, &mon, &mday, &hour, &min, &sec))) {
+		return rc;
+	}
+
+	tm.tm_year = year;
+	tm.tm_mon = mon;
+	tm.tm_mday = mday;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+
+	// Firmware time is not set, such as after a power loss.
+	// Reject it rather than anchoring a normalized date
+	if ((rc = rtc_valid_tm(&tm))) {
+		ctx->rtc.valid = 0;
+		return rc;
+	}
+	rtc_secs = rtc_tm_to_time64(&tm);
+
+	// Record drift
+	if (ctx->rtc.valid) {
+		drift_secs = rtc_secs - anchored_secs(ctx);
+		ctx->rtc.last_drift_secs = drift_secs;
+		if (abs(drift_secs) > abs(ctx->rtc.max_drift_secs)) {
+			ctx->rtc.max_drift_secs = drift_secs;
+		}
+	}
+
+	set_anchor(ctx, rtc_secs);
+	ctx->rtc.resyncs++;
+
+	return 0;
+}
+
+int input_rtc_resync(struct kbd_ctx* ctx)
+{
+	int rc;
+
+	mutex_lock(&ctx->rtc.lock);
+	rc = __input_rtc_resync(ctx);
+	mutex_unlock(&ctx->rtc.lock);
+
+	return rc;
+}
+
 static int i2c_set_time(struct device *dev, struct rtc_time *tm)
 {
 	int rc;
 
+	mutex_lock(&g_ctx->rtc.lock);
+
 	if ((rc = input_fw_set_rtc((uint8_t)tm->tm_year, (uint8_t)tm->tm_mon,
 		(uint8_t)tm->tm_mday, (uint8_t)tm->tm_hour, (uint8_t)tm->tm_min,
 		(uint8_t)tm->tm_sec))) {
 		printk(KERN_ERR "i2c_set_time failed: %d\n", rc);
+
+		// Firmware time is unknown
+		g_ctx->rtc.valid = 0;
+		mutex_unlock(&g_ctx->rtc.lock);
 		return rc;
 	}
 
+	// Anchor to newly set time
+	set_anchor(g_ctx, rtc_tm_to_time64(tm));
+
+	mutex_unlock(&g_ctx->rtc.lock);
+
 	printk(KERN_INFO "beepy-kbd: updated RTC\n");
 
 	return 0;
@@ -25,19 +113,98 @@ static int i2c_set_time(struct device *dev, struct rtc_time *tm)
 static int i2c_read_time(struct device *dev, struct rtc_time *tm)
 {
 	int rc;
-	uint8_t year, mon, mday, hour, min, sec;
 
-	if ((rc = input_fw_get_rtc(&year, &mon, &mday, &hour, &min, &sec))) {
-		printk(KERN_ERR "i2c_read_time failed: %d\n", rc);
+	mutex_lock(&g_ctx->rtc.lock);
+
+	// Read from firmware if anchor is missing or due for correction
+	if (!g_ctx->rtc.valid
+	 || ((ktime_get_boottime_ns() - g_ctx->rtc.boottime_ns)
+		>= (uint64_t)BBQX0KBD_RTC_RESYNC_PERIOD * NSEC_PER_SEC)) {
+		if ((rc = __input_rtc_resync(g_ctx))) {
+			mutex_unlock(&g_ctx->rtc.lock);
+			printk(KERN_ERR "i2c_read_time failed: %d\n", rc);
+			return rc;
+		}
+	}
+
+	// Answer from anchor
+	rtc_time64_to_tm(anchored_secs(g_ctx), tm);
+	g_ctx->rtc.reads++;
+
+	mutex_unlock(&g_ctx->rtc.lock);
+
+	return 0;
+}
+
+// Minutes from now until alarm, rounded up
+// Called with anchor lock held
+static time64_t alarm_rewake_mins(struct kbd_ctx* ctx)
+{
+	time64_t remaining_secs;
+
+	remaining_secs = ctx->rtc.alarm_secs - anchored_secs(ctx);
+	if (remaining_secs <= 0) {
+		return 0;
+	}
+
+	return DIV_ROUND_UP(remaining_secs, 60);
+}
+
+static int i2c_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	mutex_lock(&g_ctx->rtc.lock);
+
+	rtc_time64_to_tm(g_ctx->rtc.alarm_secs, &alrm->time);
+	alrm->enabled = g_ctx->rtc.alarm_enabled;
+	alrm->pending = 0;
+
+	mutex_unlock(&g_ctx->rtc.lock);
+
+	return 0;
+}
+
+// Firmware can only power on after a shutdown, in whole minutes,
+// so the alarm is stored and armed as the rewake timer at power off
+static int i2c_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	int rc;
+	time64_t alarm_secs;
+
+	alarm_secs = rtc_tm_to_time64(&alrm->time);
+
+	mutex_lock(&g_ctx->rtc.lock);
+
+	// Need current firmware time to check range
+	if (!g_ctx->rtc.valid && (rc = __input_rtc_resync(g_ctx))) {
+		mutex_unlock(&g_ctx->rtc.lock);
 		return rc;
 	}
 
-	tm->tm_year = year;
-	tm->tm_mon = mon;
-	tm->tm_mday = mday;
-	tm->tm_hour = hour;
-	tm->tm_min = min;
-	tm->tm_sec = sec;
+	// Round up to next whole minute
+	if (alarm_secs % 60) {
+		alarm_secs += 60 - (alarm_secs % 60);
+	}
+
+	// Rewake timer is a single byte of minutes
+	if (alrm->enabled
+	 && ((alarm_secs - anchored_secs(g_ctx)) > (time64_t)REWAKE_MAX_MINS * 60)) {
+		mutex_unlock(&g_ctx->rtc.lock);
+		return -ERANGE;
+	}
+
+	g_ctx->rtc.alarm_secs = alarm_secs;
+	g_ctx->rtc.alarm_enabled = alrm->enabled;
+
+	mutex_unlock(&g_ctx->rtc.lock);
+
+	return 0;
+}
+
+static int i2c_alarm_irq_enable(struct device *dev, unsigned int enabled)
+{
+	mutex_lock(&g_ctx->rtc.lock);
+	g_ctx->rtc.alarm_enabled = (enabled) ? 1 : 0;
+	mutex_unlock(&g_ctx->rtc.lock);
 
 	return 0;
 }
@@ -45,23 +212,88 @@ static int i2c_read_time(struct device *dev, struct rtc_time *tm)
 static const struct rtc_class_ops beepy_rtc_ops = {
 	.read_time = i2c_read_time,
 	.set_time = i2c_set_time,
+	.read_alarm = i2c_read_alarm,
+	.set_alarm = i2c_set_alarm,
+	.alarm_irq_enable = i2c_alarm_irq_enable,
 };
 
 int input_rtc_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 {
+	int rc;
 	struct rtc_device *rtc;
 
-	// Register RTC device
-	rtc = devm_rtc_device_register(&i2c_client->dev,
-		"beepy-rtc", &beepy_rtc_ops, THIS_MODULE);
+	// Anchor firmware time to boot time
+	mutex_init(&ctx->rtc.lock);
+	ctx->rtc.valid = 0;
+	if (input_rtc_resync(ctx)) {
+		dev_warn(&i2c_client->dev,
+			"Could not read RTC, will retry on first read\n");
+	}
+
+	// Alarm only powers on the system after a shutdown. It raises no
+	// interrupt and cannot wake the system from suspend
+	ctx->rtc.alarm_enabled = 0;
+
+	// RTC core only offers the alarm if the parent device can wake.
+	// Firmware powers the system on without the interrupt line, so this
+	// does not depend on an IRQ being assigned
+	device_init_wakeup(&i2c_client->dev, true);
+
+	// Allocate RTC device
+	rtc = devm_rtc_allocate_device(&i2c_client->dev);
 	if (IS_ERR(rtc)) {
 		dev_err(&i2c_client->dev,
-			"Failed to register RTC device\n");
+			"Failed to allocate RTC device\n");
 		return PTR_ERR(rtc);
 	}
+	rtc->ops = &beepy_rtc_ops;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0))
+	// Alarm is rounded to whole minutes
+	set_bit(RTC_FEATURE_ALARM_RES_MINUTE, rtc->features);
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0))
+	// No update interrupts, the alarm never calls rtc_update_irq
+	clear_bit(RTC_FEATURE_UPDATE_INTERRUPT, rtc->features);
+#endif
+
+	// Register RTC device
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
+	rc = devm_rtc_register_device(rtc);
+#else
+	rc = rtc_register_device(rtc);
+#endif
+	if (rc) {
+		dev_err(&i2c_client->dev,
+			"Failed to register RTC device\n");
+		return rc;
+	}
 
 	return 0;
 }
 
 void input_rtc_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
-{}
+{
+	time64_t rewake_mins;
+
+	// Only arm rewake timer when powering off, not on reboot or unload
+	if (system_state != SYSTEM_POWER_OFF) {
+		return;
+	}
+
+	mutex_lock(&ctx->rtc.lock);
+	rewake_mins = (ctx->rtc.alarm_enabled && ctx->rtc.valid)
+		? alarm_rewake_mins(ctx)
+		: 0;
+	mutex_unlock(&ctx->rtc.lock);
+
+	if (rewake_mins == 0) {
+		return;
+	}
+
+	// Firmware will power on after this many minutes
+	dev_info(&i2c_client->dev,
+		"%s Arming rewake timer for %lld minutes\n", __func__, rewake_mins);
+	(void)kbd_write_i2c_u8(i2c_client, REG_REWAKE_MINS,
+		(uint8_t)min_t(time64_t, rewake_mins, REWAKE_MAX_MINS));
+}
@@ -6,6 +6,8 @@
 
 #include <linux/input.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
 
 #include "config.h"
 #include "debug_levels.h"
@@ -17,44 +19,182 @@
 
 static uint8_t g_touch_indicator = 0;
 
-static void enable_scale_2x(struct kbd_ctx* ctx)
+// Update bits in mask of an indirect touchpad register,
+// using the register shadow to skip reads and unchanged writes
+static int update_touchpad_reg(struct kbd_ctx* ctx, uint8_t touchpad_reg,
+	uint8_t mask, uint8_t bits)
 {
-	uint8_t reg;
+	int rc;
+	uint8_t reg_value, new_value;
+	struct reg_shadow *shadow;
+
+	shadow = &ctx->shadow;
+	mutex_lock(&shadow->lock);
+
+	// Select touchpad register, skipped if already selected
+	if ((rc = kbd_update_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG,
+		0xff, touchpad_reg))) {
+		goto out;
+	}
+
+	// Get old value, from shadow if available
+	if (test_bit(touchpad_reg, shadow->touchpad_valid)) {
+		reg_value = shadow->touchpad_value[touchpad_reg];
+	} else if ((rc = kbd_read_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL,
+		&reg_value))) {
+		goto out;
+	}
+
+	// Write new value if changed
+	new_value = (reg_value & ~mask) | (bits & mask);
+	if (!test_bit(touchpad_reg, shadow->touchpad_valid)
+	 || (new_value != reg_value)) {
+		if ((rc = kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL,
+			new_value))) {
+			clear_bit(touchpad_reg, shadow->touchpad_valid);
+			goto out;
+		}
+	}
 
+	// Update shadow
+	shadow->touchpad_value[touchpad_reg] = new_value;
+	set_bit(touchpad_reg, shadow->touchpad_valid);
+
+out:
+	mutex_unlock(&shadow->lock);
+	return rc;
+}
+
+static void enable_scale_2x(struct kbd_ctx* ctx)
+{
 	// Set touchpad scaling factor to 2x for X and Y
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG, REG_TOUCHPAD_REG_SPEED);
-	kbd_read_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, &reg);
-	reg |= REG_TOUCHPAD_SPEED_X_SCALE2;
-	reg |= REG_TOUCHPAD_SPEED_Y_SCALE2;
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, reg);
+	(void)update_touchpad_reg(ctx, REG_TOUCHPAD_REG_SPEED,
+		REG_TOUCHPAD_SPEED_X_SCALE2 | REG_TOUCHPAD_SPEED_Y_SCALE2,
+		REG_TOUCHPAD_SPEED_X_SCALE2 | REG_TOUCHPAD_SPEED_Y_SCALE2);
 
 	// Enable touchpad scaling
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG, REG_TOUCHPAD_REG_ENGINE);
-	kbd_read_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, &reg);
-	reg |= REG_TOUCHPAD_ENGINE_XY_SCALE;
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, reg);
+	(void)update_touchpad_reg(ctx, REG_TOUCHPAD_REG_ENGINE,
+		REG_TOUCHPAD_ENGINE_XY_SCALE, REG_TOUCHPAD_ENGINE_XY_SCALE);
 }
 
 static void disable_scale_2x(struct kbd_ctx* ctx)
 {
-	uint8_t reg;
-
 	// Clear touchpad scaling factor to 2x for X and Y
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG, REG_TOUCHPAD_REG_SPEED);
-	kbd_read_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, &reg);
-	reg &= ~REG_TOUCHPAD_SPEED_X_SCALE2;
-	reg &= ~REG_TOUCHPAD_SPEED_Y_SCALE2;
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, reg);
+	(void)update_touchpad_reg(ctx, REG_TOUCHPAD_REG_SPEED,
+		REG_TOUCHPAD_SPEED_X_SCALE2 | REG_TOUCHPAD_SPEED_Y_SCALE2, 0);
 
 	// Clear touchpad scaling
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG, REG_TOUCHPAD_REG_ENGINE);
-	kbd_read_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, &reg);
-	reg &= ~REG_TOUCHPAD_ENGINE_XY_SCALE;
-	kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL, reg);
+	(void)update_touchpad_reg(ctx, REG_TOUCHPAD_REG_ENGINE,
+		REG_TOUCHPAD_ENGINE_XY_SCALE, 0);
+}
+
+// Rewrite shadowed touchpad registers after a firmware reset
+void input_touch_resync(struct kbd_ctx* ctx)
+{
+	static uint8_t const resync_regs[] = {
+		REG_TOUCHPAD_REG_SPEED, REG_TOUCHPAD_REG_ENGINE,
+	};
+	int i;
+	uint8_t touchpad_reg;
+	struct reg_shadow *shadow;
+
+	shadow = &ctx->shadow;
+	mutex_lock(&shadow->lock);
+
+	for (i = 0; i < ARRAY_SIZE(resync_regs); i++) {
+		touchpad_reg = resync_regs[i];
+		if (!test_bit(touchpad_reg, shadow->touchpad_valid)) {
+			continue;
+		}
+		if (kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_REG, touchpad_reg)
+		 || kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_VAL,
+			shadow->touchpad_value[touchpad_reg])) {
+			clear_bit(touchpad_reg, shadow->touchpad_valid);
+		}
+	}
+
+	mutex_unlock(&shadow->lock);
+}
+
+// Touchpad LED power
+
+// Write LED power level for current state, skipped by register cache if unchanged.
+// Sensor shutdown is not reachable through the indirect touchpad registers,
+// so gating only lowers LED power
+// Called with touch power lock held
+static int write_touch_led(struct kbd_ctx* ctx)
+{
+	uint8_t led_value;
+
+	led_value = (ctx->touch.power.gated || ctx->touch.led_dimmed)
+		? TOUCHPAD_LED_LOW
+		: ctx->touch.led_setting;
+
+	return kbd_update_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_LED, 0xff, led_value);
+}
+
+// Add time since last transition to the current state
+// Called with touch power lock held
+static void account_touch_power(struct touch_power* power, uint64_t now)
+{
+	if (power->gated) {
+		power->gated_ns += now - power->state_since;
+	} else {
+		power->active_ns += now - power->state_since;
+	}
+	power->state_since = now;
+}
+
+// Called with touch power lock held
+static void set_touch_gated(struct kbd_ctx* ctx, uint8_t gated)
+{
+	struct touch_power *power;
+
+	power = &ctx->touch.power;
+	if (gated == power->gated) {
+		return;
+	}
+
+	account_touch_power(power, ktime_get_boottime_ns());
+	power->gated = gated;
+	if (gated) {
+		power->gates++;
+	} else {
+		power->ungates++;
+	}
+
+	(void)write_touch_led(ctx);
+}
+
+static void touch_gate_work_handler(struct work_struct* work)
+{
+	struct touch_power *power;
+	struct kbd_ctx *ctx;
+
+	power = container_of(to_delayed_work(work), struct touch_power, gate_work);
+	ctx = container_of(power, struct kbd_ctx, touch.power);
+
+	// Touch may have been enabled again since work was queued
+	mutex_lock(&power->lock);
+	if (!ctx->touch.enabled) {
+		set_touch_gated(ctx, 1);
+	}
+	mutex_unlock(&power->lock);
+}
+
+// Cancel LED power gating if probe fails after it was queued, or on device release
+static void cancel_touch_gate_work(void *data)
+{
+	struct kbd_ctx *ctx;
+
+	ctx = (struct kbd_ctx *)data;
+	cancel_delayed_work_sync(&ctx->touch.power.gate_work);
 }
 
 int input_touch_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 {
+	int rc;
+
 	ctx->touch.x = 0;
 	ctx->touch.dx = 0;
 	ctx->touch.y = 0;
@@ -64,6 +204,23 @@ int input_touch_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 	ctx->touch.entry_while_shift_held = 0;
 	ctx->touch.threshold = 8;
 
+	ctx->touch.led_setting = TOUCHPAD_LED_HIGH;
+	ctx->touch.led_dimmed = 0;
+
+	// Touchpad LED starts at configured power
+	mutex_init(&ctx->touch.power.lock);
+	INIT_DELAYED_WORK(&ctx->touch.power.gate_work, touch_gate_work_handler);
+	ctx->touch.power.gated = 0;
+	ctx->touch.power.gates = 0;
+	ctx->touch.power.ungates = 0;
+	ctx->touch.power.state_since = ktime_get_boottime_ns();
+	ctx->touch.power.active_ns = 0;
+	ctx->touch.power.gated_ns = 0;
+	if ((rc = devm_add_action_or_reset(&i2c_client->dev,
+		cancel_touch_gate_work, ctx))) {
+		return rc;
+	}
+
 	// Default touch settings
 	input_touch_set_activation(ctx, TOUCH_ACT_CLICK);
 	input_touch_set_input_as(ctx, TOUCH_INPUT_AS_KEYS);
@@ -72,7 +229,9 @@ int input_touch_probe(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
 }
 
 void input_touch_shutdown(struct i2c_client* i2c_client, struct kbd_ctx *ctx)
-{}
+{
+	cancel_delayed_work_sync(&ctx->touch.power.gate_work);
+}
 
 void input_touch_report_event(struct kbd_ctx *ctx)
 {
@@ -243,6 +402,13 @@ void input_touch_enable(struct kbd_ctx *ctx)
 {
 	ctx->touch.enabled = 1;
 	input_fw_enable_touch_interrupts(ctx);
+
+	// Restore LED power only if it was lowered,
+	// so toggling touch with Shift does not write to firmware
+	cancel_delayed_work(&ctx->touch.power.gate_work);
+	mutex_lock(&ctx->touch.power.lock);
+	set_touch_gated(ctx, 0);
+	mutex_unlock(&ctx->touch.power.lock);
 }
 
 void input_touch_disable(struct kbd_ctx *ctx)
@@ -250,12 +416,54 @@ void input_touch_disable(struct kbd_ctx *ctx)
 	ctx->touch.enabled = 0;
 	input_fw_disable_touch_interrupts(ctx);
 
+	// Lower LED power if touch stays off. Work is frozen during system suspend
+	mod_delayed_work(system_freezable_power_efficient_wq,
+		&ctx->touch.power.gate_work,
+		msecs_to_jiffies(BBQX0KBD_TOUCH_GATE_DELAY));
+
 	if (g_touch_indicator) {
 		g_touch_indicator = 0;
 		input_display_clear_indicator(6);
 	}
 }
 
+// Set touchpad LED power level, applied once no longer dimmed or gated
+int input_touch_set_led(struct kbd_ctx *ctx, uint8_t led_setting)
+{
+	int rc;
+
+	mutex_lock(&ctx->touch.power.lock);
+	ctx->touch.led_setting = led_setting;
+	rc = write_touch_led(ctx);
+	mutex_unlock(&ctx->touch.power.lock);
+
+	return rc;
+}
+
+// Lower touchpad LED power while idle
+void input_touch_dim_led(struct kbd_ctx *ctx, uint8_t dimmed)
+{
+	mutex_lock(&ctx->touch.power.lock);
+	if (dimmed != ctx->touch.led_dimmed) {
+		ctx->touch.led_dimmed = dimmed;
+		(void)write_touch_led(ctx);
+	}
+	mutex_unlock(&ctx->touch.power.lock);
+}
+
+// Get LED power transitions, with time up to now
+void input_touch_get_power(struct kbd_ctx *ctx, struct touch_power* power)
+{
+	mutex_lock(&ctx->touch.power.lock);
+	account_touch_power(&ctx->touch.power, ktime_get_boottime_ns());
+	power->gated = ctx->touch.power.gated;
+	power->gates = ctx->touch.power.gates;
+	power->ungates = ctx->touch.power.ungates;
+	power->active_ns = ctx->touch.power.active_ns;
+	power->gated_ns = ctx->touch.power.gated_ns;
+	mutex_unlock(&ctx->touch.power.lock);
+}
+
 void input_touch_set_activation(struct kbd_ctx *ctx, uint8_t activation)
 {
 	if (activation == TOUCH_ACT_ALWAYS) {
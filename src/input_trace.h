@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Kernel driver for Q20 keyboard by ardangelo
+ * input_trace.h: Tracepoints for each stage of the key pipeline
+ * Enable with `echo 1 > /sys/kernel/tracing/events/beepy_kbd/enable`
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM beepy_kbd
+
+#if !defined(INPUT_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define INPUT_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#include "input_iface.h"
+
+#define show_report_path(path) __print_symbolic(path, \
+	{ REPORT_PATH_WORKER, "worker" }, \
+	{ REPORT_PATH_IRQ, "irq" }, \
+	{ REPORT_PATH_POLL, "poll" })
+
+#define show_key_consumer(consumer) __print_symbolic(consumer, \
+	{ KEY_CONSUMER_NONE, "none" }, \
+	{ KEY_CONSUMER_POWER, "power" }, \
+	{ KEY_CONSUMER_FW, "fw" }, \
+	{ KEY_CONSUMER_TOUCH, "touch" }, \
+	{ KEY_CONSUMER_MODIFIERS, "modifiers" }, \
+	{ KEY_CONSUMER_META, "meta" }, \
+	{ KEY_CONSUMER_PASSTHROUGH, "passthrough" })
+
+// IRQ handler entered
+TRACE_EVENT(beepy_kbd_irq,
+	TP_PROTO(int irq),
+	TP_ARGS(irq),
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+	TP_printk("irq=%d", __entry->irq)
+);
+
+// REG_INT read from firmware
+TRACE_EVENT(beepy_kbd_int_status,
+	TP_PROTO(uint8_t irq_type),
+	TP_ARGS(irq_type),
+	TP_STRUCT__entry(
+		__field(uint8_t, irq_type)
+	),
+	TP_fast_assign(
+		__entry->irq_type = irq_type;
+	),
+	TP_printk("int=0x%02x", __entry->irq_type)
+);
+
+// Firmware FIFO items read
+TRACE_EVENT(beepy_kbd_fifo_read,
+	TP_PROTO(uint8_t count),
+	TP_ARGS(count),
+	TP_STRUCT__entry(
+		__field(uint8_t, count)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+	),
+	TP_printk("count=%u", __entry->count)
+);
+
+// Started reporting queued events
+TRACE_EVENT(beepy_kbd_report_start,
+	TP_PROTO(int path, unsigned int queued),
+	TP_ARGS(path, queued),
+	TP_STRUCT__entry(
+		__field(int, path)
+		__field(unsigned int, queued)
+	),
+	TP_fast_assign(
+		__entry->path = path;
+		__entry->queued = queued;
+	),
+	TP_printk("path=%s queued=%u",
+		show_report_path(__entry->path), __entry->queued)
+);
+
+// Key event handled
+TRACE_EVENT(beepy_kbd_key,
+	TP_PROTO(uint8_t scancode, uint8_t state, uint8_t keycode, int consumer),
+	TP_ARGS(scancode, state, keycode, consumer),
+	TP_STRUCT__entry(
+		__field(uint8_t, scancode)
+		__field(uint8_t, state)
+		__field(uint8_t, keycode)
+		__field(int, consumer)
+	),
+	TP_fast_assign(
+		__entry->scancode = scancode;
+		__entry->state = state;
+		__entry->keycode = keycode;
+		__entry->consumer = consumer;
+	),
+	TP_printk("scancode=0x%02x state=%u keycode=%u consumer=%s",
+		__entry->scancode, __entry->state, __entry->keycode,
+		show_key_consumer(__entry->consumer))
+);
+
+// Input system synchronized
+TRACE_EVENT(beepy_kbd_sync,
+	TP_PROTO(int path),
+	TP_ARGS(path),
+	TP_STRUCT__entry(
+		__field(int, path)
+	),
+	TP_fast_assign(
+		__entry->path = path;
+	),
+	TP_printk("path=%s", show_report_path(__entry->path))
+);
+
+// REG_INT cleared in firmware
+TRACE_EVENT(beepy_kbd_int_ack,
+	TP_PROTO(int rc),
+	TP_ARGS(rc),
+	TP_STRUCT__entry(
+		__field(int, rc)
+	),
+	TP_fast_assign(
+		__entry->rc = rc;
+	),
+	TP_printk("rc=%d", __entry->rc)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE input_trace
+#include <trace/define_trace.h>
@@ -8,6 +8,7 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/i2c.h>
+#include <linux/pm.h>
 
 #include "config.h"
 #include "debug_levels.h"
@@ -15,10 +16,7 @@
 #include "input_iface.h"
 #include "params_iface.h"
 #include "sysfs_iface.h"
-
-#if (BBQX0KBD_INT != BBQX0KBD_USE_INT)
-#error "Only supporting interrupts mode right now"
-#endif
+#include "debugfs_iface.h"
 
 #if (BBQX0KBD_TYPE != BBQ20KBD_PMOD)
 #error "Only supporting BBQ20 keyboard right now"
@@ -48,16 +46,34 @@ static int beepy_kbd_probe
 		return rc;
 	}
 
+	// Initialize debugfs interface
+	if ((rc = debugfs_probe(i2c_client))) {
+		return rc;
+	}
+
 	return 0;
 }
 
 static void beepy_kbd_shutdown(struct i2c_client* i2c_client)
 {
+	debugfs_shutdown(i2c_client);
 	sysfs_shutdown(i2c_client);
 	params_shutdown();
 	input_shutdown(i2c_client);
 }
 
+static int __maybe_unused beepy_kbd_suspend(struct device* dev)
+{
+	return input_suspend(to_i2c_client(dev));
+}
+
+static int __maybe_unused beepy_kbd_resume(struct device* dev)
+{
+	return input_resume(to_i2c_client(dev));
+}
+
+static SIMPLE_DEV_PM_OPS(beepy_kbd_pm_ops, beepy_kbd_suspend, beepy_kbd_resume);
+
 static void beepy_kbd_remove(struct i2c_client* i2c_client)
 {
 	dev_info_fe(&i2c_client->dev,
@@ -85,6 +101,7 @@ static struct i2c_driver beepy_kbd_driver = {
 	.driver = {
 		.name = "beepy-kbd",
 		.of_match_table = beepy_kbd_of_device_id,
+		.pm = &beepy_kbd_pm_ops,
 	},
 	.probe    = beepy_kbd_probe,
 	.shutdown = beepy_kbd_shutdown,
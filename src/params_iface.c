@@ -7,12 +7,14 @@
 #include <linux/types.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/cpumask.h>
 
 #include "config.h"
 
 #include "i2c_helper.h"
 #include "input_iface.h"
 #include "params_iface.h"
+#include "sysfs_iface.h"
 
 // Kernel module parameters
 static char *touch_act_setting = "click"; // "click" or "always"
@@ -25,6 +27,21 @@ static char *handle_poweroff_setting = "0"; // Enable to have module invoke powe
 static char *shutdown_grace_setting = "30"; // 30 seconds between shutdown signal and poweroff
 static char *sharp_path_setting = "/dev/dri/card0"; // Path to Sharp display device
 static uint32_t sysfs_gid_setting = 0; // GID of files in /sys/firmware/beepy
+static char *input_mode_setting = // "irq", "poll", or "hybrid"
+#if (BBQX0KBD_INT == BBQX0KBD_NO_INT)
+"poll";
+#else
+"irq";
+#endif
+static uint32_t hybrid_quiet_ms_setting = BBQX0KBD_HYBRID_QUIET_PERIOD; // Poll for this long after last event in hybrid mode
+static uint32_t battery_poll_ms_setting = BBQX0KBD_BATTERY_PERIOD; // Battery level sampling period
+static uint32_t idle_ms_setting = BBQX0KBD_IDLE_PERIOD; // Milliseconds without keypress before idle
+static uint32_t dim_ms_setting = 0; // Milliseconds without keypress before dimming backlight
+static char *dim_touch_led_setting = "1"; // Also lower touchpad LED power while dimmed
+static uint32_t notify_ms_setting = BBQX0KBD_NOTIFY_PERIOD; // Minimum period between sysfs change notifications
+static char *report_in_irq_setting = "0"; // Report key events from IRQ thread instead of input worker
+static char *worker_sched_setting = "normal"; // "normal", "fifo_low", or "fifo"
+static char *worker_cpus_setting = ""; // CPU list for input worker, empty for all CPUs
 static char *auto_off_setting = // Enable to trigger a 30 second poweroff timer on driver unload
 #ifdef DEBUG
 "0";
@@ -262,21 +279,29 @@ MODULE_PARM_DESC(touch_threshold_setting, "Send touch event above this threshold
 // Set touchpad LED power level
 static int set_touch_led_setting(struct kbd_ctx* ctx, char const* val)
 {
+	uint8_t led_setting;
+
 	if (strcmp(val, "low") == 0) {
-		(void)kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_LED, TOUCHPAD_LED_LOW);
-		return 0;
+		led_setting = TOUCHPAD_LED_LOW;
 
 	} else if (strcmp(val, "med") == 0) {
-		(void)kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_LED, TOUCHPAD_LED_MED);
-		return 0;
+		led_setting = TOUCHPAD_LED_MED;
 
 	} else if (strcmp(val, "high") == 0) {
-		(void)kbd_write_i2c_u8(ctx->i2c_client, REG_TOUCHPAD_LED, TOUCHPAD_LED_HIGH);
+		led_setting = TOUCHPAD_LED_HIGH;
+
+	} else {
+		// Invalid parameter value
+		return -1;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
 		return 0;
 	}
 
-	// Invalid parameter value
-	return -1;
+	(void)input_touch_set_led(ctx, led_setting);
+	return 0;
 }
 
 // Touchpad LED level
@@ -466,6 +491,447 @@ static const struct kernel_param_ops auto_off_setting_param_ops = {
 module_param_cb(auto_off, &auto_off_setting_param_ops, &auto_off_setting, 0664);
 MODULE_PARM_DESC(auto_off_setting, "Automatically shut down and enter deep sleep when driver is unloaded");
 
+// Update key event reporting context
+static int set_report_in_irq_setting(struct kbd_ctx *ctx, char const* val)
+{
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	input_set_report_in_irq(ctx, val[0] != '0');
+	return 0;
+}
+
+// Report key events directly from IRQ thread
+static int report_in_irq_setting_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	char stripped_val_buf[2];
+
+	// Copy provided value to buffer and strip it of newlines
+	strncpy(stripped_val_buf, val, 2);
+	stripped_val_buf[1] = '\0';
+	stripped_val = strstrip(stripped_val_buf);
+
+	return (set_report_in_irq_setting(g_ctx, stripped_val) < 0)
+		? -EINVAL
+		: param_set_charp(stripped_val, kp);
+}
+
+static const struct kernel_param_ops report_in_irq_setting_param_ops = {
+	.set = report_in_irq_setting_param_set,
+	.get = param_get_charp,
+};
+
+module_param_cb(report_in_irq, &report_in_irq_setting_param_ops, &report_in_irq_setting, 0664);
+MODULE_PARM_DESC(report_in_irq_setting, "Set to 1 to report key events from the IRQ thread instead of the input worker thread");
+
+// Update input mode in global context, if available
+static int set_input_mode_setting(struct kbd_ctx* ctx, char const* val)
+{
+	uint8_t input_mode;
+
+	// Keyboard interrupt line
+	if (strcmp(val, "irq") == 0) {
+		input_mode = INPUT_MODE_IRQ;
+
+	// Adaptive polling
+	} else if (strcmp(val, "poll") == 0) {
+		input_mode = INPUT_MODE_POLL;
+
+	// Interrupt, then poll during bursts of events
+	} else if (strcmp(val, "hybrid") == 0) {
+		input_mode = INPUT_MODE_HYBRID;
+
+	// Invalid parameter value
+	} else {
+		return -EINVAL;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	return input_set_mode(ctx, input_mode);
+}
+
+// Check for input with interrupts or polling
+static int input_mode_setting_param_set(const char *val, const struct kernel_param* kp)
+{
+	char buf[8];
+	char *stripped_val;
+
+	stripped_val = copy_and_strip(buf, sizeof(buf), val);
+
+	return (set_input_mode_setting(g_ctx, stripped_val) < 0)
+		? -EINVAL
+		: param_set_charp(stripped_val, kp);
+}
+
+static const struct kernel_param_ops input_mode_setting_param_ops = {
+	.set = input_mode_setting_param_set,
+	.get = param_get_charp,
+};
+module_param_cb(input_mode, &input_mode_setting_param_ops, &input_mode_setting, 0664);
+MODULE_PARM_DESC(input_mode_setting, "Check for input on keyboard interrupt (\"irq\"), by adaptive polling (\"poll\"), or interrupt then poll during bursts (\"hybrid\")");
+
+// Set hybrid mode quiet window
+static int set_hybrid_quiet_ms_setting(struct kbd_ctx *ctx, unsigned int val)
+{
+	// Check setting
+	if ((val < BBQX0KBD_POLL_MIN_PERIOD) || (val > 1000)) {
+		return -EINVAL;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Store setting
+	input_set_hybrid_quiet_ms(ctx, val);
+
+	return 0;
+}
+
+// Hybrid mode quiet window in milliseconds
+static int hybrid_quiet_ms_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	unsigned int parsed_val;
+	char stripped_val_buf[5];
+
+	// Copy provided value to buffer and strip it of newlines
+	strncpy(stripped_val_buf, val, 5);
+	stripped_val_buf[4] = '\0';
+	stripped_val = strstrip(stripped_val_buf);
+
+	// Parse setting
+	if (kstrtouint(stripped_val, 10, &parsed_val)) {
+		return -EINVAL;
+	}
+
+	return (set_hybrid_quiet_ms_setting(g_ctx, parsed_val) < 0)
+		? -EINVAL
+		: param_set_uint(stripped_val, kp);
+}
+
+static const struct kernel_param_ops hybrid_quiet_ms_param_ops = {
+	.set = hybrid_quiet_ms_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(hybrid_quiet_ms, &hybrid_quiet_ms_param_ops, &hybrid_quiet_ms_setting, 0664);
+MODULE_PARM_DESC(hybrid_quiet_ms_setting, "In hybrid mode, return to interrupts after this many milliseconds without input (4 - 1000, default 50)");
+
+// Set battery sampling period
+static int set_battery_poll_ms_setting(struct kbd_ctx *ctx, unsigned int val)
+{
+	// Check setting
+	if ((val < 1000) || (val > 600000)) {
+		return -EINVAL;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Store setting
+	input_battery_set_period_ms(ctx, val);
+
+	return 0;
+}
+
+// Battery sampling period in milliseconds
+static int battery_poll_ms_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	unsigned int parsed_val;
+	char stripped_val_buf[8];
+
+	stripped_val = copy_and_strip(stripped_val_buf, sizeof(stripped_val_buf), val);
+
+	// Parse setting
+	if (kstrtouint(stripped_val, 10, &parsed_val)) {
+		return -EINVAL;
+	}
+
+	return (set_battery_poll_ms_setting(g_ctx, parsed_val) < 0)
+		? -EINVAL
+		: param_set_uint(stripped_val, kp);
+}
+
+static const struct kernel_param_ops battery_poll_ms_param_ops = {
+	.set = battery_poll_ms_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(battery_poll_ms, &battery_poll_ms_param_ops, &battery_poll_ms_setting, 0664);
+MODULE_PARM_DESC(battery_poll_ms_setting, "Milliseconds between battery level samples (1000 - 600000, default 10000)");
+
+// Set idle period
+static int set_idle_ms_setting(struct kbd_ctx *ctx, unsigned int val)
+{
+	// Check setting, 0 disables idle detection
+	if ((val != 0) && ((val < 1000) || (val > 3600000))) {
+		return -EINVAL;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Store setting
+	input_idle_set_timeout_ms(ctx, val);
+
+	return 0;
+}
+
+// Idle period in milliseconds
+static int idle_ms_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	unsigned int parsed_val;
+	char stripped_val_buf[9];
+
+	stripped_val = copy_and_strip(stripped_val_buf, sizeof(stripped_val_buf), val);
+
+	// Parse setting
+	if (kstrtouint(stripped_val, 10, &parsed_val)) {
+		return -EINVAL;
+	}
+
+	return (set_idle_ms_setting(g_ctx, parsed_val) < 0)
+		? -EINVAL
+		: param_set_uint(stripped_val, kp);
+}
+
+static const struct kernel_param_ops idle_ms_param_ops = {
+	.set = idle_ms_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(idle_ms, &idle_ms_param_ops, &idle_ms_setting, 0664);
+MODULE_PARM_DESC(idle_ms_setting, "Milliseconds without a keypress before idle, 0 to disable (1000 - 3600000, default 30000)");
+
+// Set backlight dimming period
+static int set_dim_ms_setting(struct kbd_ctx *ctx, unsigned int val)
+{
+	// Check setting, 0 disables dimming
+	if ((val != 0) && ((val < 1000) || (val > 3600000))) {
+		return -EINVAL;
+	}
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Store setting
+	input_idle_set_dim_ms(ctx, val);
+
+	return 0;
+}
+
+// Backlight dimming period in milliseconds
+static int dim_ms_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	unsigned int parsed_val;
+	char stripped_val_buf[9];
+
+	stripped_val = copy_and_strip(stripped_val_buf, sizeof(stripped_val_buf), val);
+
+	// Parse setting
+	if (kstrtouint(stripped_val, 10, &parsed_val)) {
+		return -EINVAL;
+	}
+
+	return (set_dim_ms_setting(g_ctx, parsed_val) < 0)
+		? -EINVAL
+		: param_set_uint(stripped_val, kp);
+}
+
+static const struct kernel_param_ops dim_ms_param_ops = {
+	.set = dim_ms_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(dim_ms, &dim_ms_param_ops, &dim_ms_setting, 0664);
+MODULE_PARM_DESC(dim_ms_setting, "Milliseconds without a keypress before fading out keyboard backlight, 0 to disable (1000 - 3600000, default 0)");
+
+// Update touchpad LED dimming setting in global context, if available
+static int set_dim_touch_led_setting(struct kbd_ctx *ctx, char const* val)
+{
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Parse and update setting
+	input_idle_set_dim_touch_led(ctx, (val && val[0] == '1'));
+
+	return 0;
+}
+
+// Lower touchpad LED power while dimmed
+static int dim_touch_led_setting_param_set(const char *val, const struct kernel_param *kp)
+{
+	char buf[4];
+	char *stripped_val;
+
+	stripped_val = copy_and_strip(buf, sizeof(buf), val);
+
+	return (set_dim_touch_led_setting(g_ctx, stripped_val) < 0)
+		? -EINVAL
+		: param_set_charp(stripped_val, kp);
+}
+
+static const struct kernel_param_ops dim_touch_led_setting_param_ops = {
+	.set = dim_touch_led_setting_param_set,
+	.get = param_get_charp,
+};
+
+module_param_cb(dim_touch_led, &dim_touch_led_setting_param_ops, &dim_touch_led_setting, 0664);
+MODULE_PARM_DESC(dim_touch_led_setting, "Set to 1 to also lower touchpad LED power while keyboard backlight is dimmed");
+
+// Set minimum period between change notifications
+static int set_notify_ms_setting(char const* val)
+{
+	int rc;
+	unsigned int parsed_val;
+
+	// Parse setting
+	if ((rc = kstrtouint(val, 10, &parsed_val))) {
+		return rc;
+	}
+
+	// Check setting
+	if (parsed_val > 60000) {
+		return -EINVAL;
+	}
+
+	// Store setting
+	sysfs_set_notify_ms(parsed_val);
+
+	return 0;
+}
+
+// Minimum period between change notifications in milliseconds
+static int notify_ms_param_set(const char *val, const struct kernel_param *kp)
+{
+	char *stripped_val;
+	char stripped_val_buf[7];
+
+	stripped_val = copy_and_strip(stripped_val_buf, sizeof(stripped_val_buf), val);
+
+	return (set_notify_ms_setting(stripped_val) < 0)
+		? -EINVAL
+		: param_set_uint(stripped_val, kp);
+}
+
+static const struct kernel_param_ops notify_ms_param_ops = {
+	.set = notify_ms_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(notify_ms, &notify_ms_param_ops, &notify_ms_setting, 0664);
+MODULE_PARM_DESC(notify_ms_setting, "Minimum milliseconds between sysfs change notifications (0 - 60000, default 1000)");
+
+// Update input worker scheduling policy
+static int set_worker_sched_setting(struct kbd_ctx* ctx, char const* val)
+{
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	// Highest normal priority
+	if (strcmp(val, "normal") == 0) {
+		return input_set_worker_sched(ctx, WORKER_SCHED_NORMAL);
+
+	// Realtime, below threaded IRQ handlers
+	} else if (strcmp(val, "fifo_low") == 0) {
+		return input_set_worker_sched(ctx, WORKER_SCHED_FIFO_LOW);
+
+	// Realtime, same as threaded IRQ handlers
+	} else if (strcmp(val, "fifo") == 0) {
+		return input_set_worker_sched(ctx, WORKER_SCHED_FIFO);
+	}
+
+	// Invalid parameter value
+	return -1;
+}
+
+// Input worker scheduling policy
+static int worker_sched_setting_param_set(const char *val, const struct kernel_param* kp)
+{
+	char buf[10];
+	char *stripped_val;
+
+	stripped_val = copy_and_strip(buf, sizeof(buf), val);
+
+	return (set_worker_sched_setting(g_ctx, stripped_val) < 0)
+		? -EINVAL
+		: param_set_charp(stripped_val, kp);
+}
+
+static const struct kernel_param_ops worker_sched_setting_param_ops = {
+	.set = worker_sched_setting_param_set,
+	.get = param_get_charp,
+};
+module_param_cb(worker_sched, &worker_sched_setting_param_ops, &worker_sched_setting, 0664);
+MODULE_PARM_DESC(worker_sched_setting, "Input worker scheduling (\"normal\", \"fifo_low\", \"fifo\")");
+
+// Update input worker CPU affinity
+static int set_worker_cpus_setting(struct kbd_ctx* ctx, char const* val)
+{
+	int rc;
+	cpumask_var_t cpus;
+
+	// If no state was passed, exit
+	if (!ctx) {
+		return 0;
+	}
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
+
+	// Parse CPU list such as "0" or "1-3", empty for all CPUs
+	if ((val[0] == '\0') || !(rc = cpulist_parse(val, cpus))) {
+		rc = input_set_worker_cpus(ctx, cpus);
+	}
+
+	free_cpumask_var(cpus);
+
+	return rc;
+}
+
+// Input worker CPU list
+static int worker_cpus_setting_param_set(const char *val, const struct kernel_param* kp)
+{
+	char buf[32];
+	char *stripped_val;
+
+	stripped_val = copy_and_strip(buf, sizeof(buf), val);
+
+	return (set_worker_cpus_setting(g_ctx, stripped_val) < 0)
+		? -EINVAL
+		: param_set_charp(stripped_val, kp);
+}
+
+static const struct kernel_param_ops worker_cpus_setting_param_ops = {
+	.set = worker_cpus_setting_param_set,
+	.get = param_get_charp,
+};
+module_param_cb(worker_cpus, &worker_cpus_setting_param_ops, &worker_cpus_setting, 0664);
+MODULE_PARM_DESC(worker_cpus_setting, "CPU list for input worker, such as \"0\" or \"1-3\" (default all CPUs)");
+
 // No setup
 int params_probe(void)
 {
@@ -481,12 +947,47 @@ int params_probe(void)
 	if ((rc = set_touch_min_squal_setting(g_ctx, touch_min_squal_setting)) < 0) {
 		return rc;
 	}
+	if ((rc = set_touch_led_setting(g_ctx, touch_led_setting)) < 0) {
+		return rc;
+	}
 	if ((rc = set_handle_poweroff_setting(g_ctx, handle_poweroff_setting)) < 0) {
 		return rc;
 	}
 	if ((rc = set_auto_off_setting(g_ctx, auto_off_setting)) < 0) {
 		return rc;
 	}
+	if ((rc = set_report_in_irq_setting(g_ctx, report_in_irq_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_dim_touch_led_setting(g_ctx, dim_touch_led_setting)) < 0) {
+		return rc;
+	}
+
+	if ((rc = set_worker_sched_setting(g_ctx, worker_sched_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_worker_cpus_setting(g_ctx, worker_cpus_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_battery_poll_ms_setting(g_ctx, battery_poll_ms_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_hybrid_quiet_ms_setting(g_ctx, hybrid_quiet_ms_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_idle_ms_setting(g_ctx, idle_ms_setting)) < 0) {
+		return rc;
+	}
+	if ((rc = set_dim_ms_setting(g_ctx, dim_ms_setting)) < 0) {
+		return rc;
+	}
+
+	// Polling stays enabled if no IRQ line was available,
+	// but the setting is still checked
+	if ((rc = set_input_mode_setting(
+		(g_ctx && (g_ctx->irq > 0)) ? g_ctx : NULL, input_mode_setting)) < 0) {
+		return rc;
+	}
 
 	return 0;
 }
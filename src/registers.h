@@ -112,8 +112,13 @@
 #define REG_LED_R 						0x21
 #define REG_LED_G 						0x22
 #define REG_LED_B 						0x23
+#define REG_LED_MODE_OFF 0x0
+#define REG_LED_MODE_ON 0x1
+#define REG_LED_MODE_FLASH 0x2
+#define REG_LED_MODE_FLASH_UNTIL_KEY 0x3
 
 #define REG_REWAKE_MINS 0x24
+#define REWAKE_MAX_MINS 0xff
 #define REG_SHUTDOWN_GRACE 0x25
 
 #define REG_RTC_SEC 0x26
@@ -123,6 +128,7 @@
 #define REG_RTC_MON 0x2A
 #define REG_RTC_YEAR 0x2B
 #define REG_RTC_COMMIT 0x2C
+#define RTC_NUM_REGS (REG_RTC_YEAR - REG_RTC_SEC + 1)
 
 #define REG_DRIVER_STATE 0x2D
 
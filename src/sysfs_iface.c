@@ -11,6 +11,8 @@
 #include <linux/kobject.h>
 #include <linux/timekeeping.h>
 #include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
 
 #include "config.h"
 
@@ -19,38 +21,37 @@
 #include "params_iface.h"
 #include "sysfs_iface.h"
 
-// Read battery level over I2C
-static int read_raw_battery_level(void)
+static int parse_and_write_i2c_u8(char const* buf, size_t count, uint8_t reg)
 {
-	int rc;
-	uint8_t battery_level[2];
+	int parsed;
 
-	// Make sure I2C client was initialized
-	if ((g_ctx == NULL) || (g_ctx->i2c_client == NULL)) {
+	// Parse string entry
+	if ((parsed = parse_u8(buf)) < 0) {
 		return -EINVAL;
 	}
 
-	// Read battery level
-	if ((rc = kbd_read_i2c_2u8(g_ctx->i2c_client, REG_ADC, battery_level)) < 0) {
-		return rc;
+	// Write value to LED register if available
+	if (g_ctx && g_ctx->i2c_client) {
+		kbd_write_i2c_u8(g_ctx->i2c_client, reg, (uint8_t)parsed);
 	}
 
-	// Calculate raw battery level
-	return (battery_level[1] << 8) | battery_level[0];
+	return count;
 }
 
-static int parse_and_write_i2c_u8(char const* buf, size_t count, uint8_t reg)
+static int parse_and_write_led_reg(char const* buf, size_t count, uint8_t reg)
 {
-	int parsed;
+	int rc, parsed;
 
 	// Parse string entry
 	if ((parsed = parse_u8(buf)) < 0) {
 		return -EINVAL;
 	}
 
-	// Write value to LED register if available
+	// Update LED setting
 	if (g_ctx && g_ctx->i2c_client) {
-		kbd_write_i2c_u8(g_ctx->i2c_client, reg, (uint8_t)parsed);
+		if ((rc = input_leds_set_reg(g_ctx, reg, (uint8_t)parsed))) {
+			return rc;
+		}
 	}
 
 	return count;
@@ -62,15 +63,16 @@ static int parse_and_write_i2c_u8(char const* buf, size_t count, uint8_t reg)
 static ssize_t battery_raw_show(struct kobject *kobj, struct kobj_attribute *attr,
 	char *buf)
 {
-	int total_level;
+	int rc;
+	struct battery_reading reading;
 
-	// Read raw level
-	if ((total_level = read_raw_battery_level()) < 0) {
-		return total_level;
+	// Get filtered level from last sample
+	if ((rc = input_battery_get(&reading))) {
+		return rc;
 	}
 
 	// Format into buffer
-	return sprintf(buf, "%d\n", total_level);
+	return sprintf(buf, "%d\n", reading.raw);
 }
 struct kobj_attribute battery_raw_attr
 	= __ATTR(battery_raw, 0444, battery_raw_show, NULL);
@@ -79,56 +81,35 @@ struct kobj_attribute battery_raw_attr
 static ssize_t battery_volts_show(struct kobject *kobj, struct kobj_attribute *attr,
 	char *buf)
 {
-	int volts_fp;
+	int rc;
+	struct battery_reading reading;
 
-	// Read raw level
-	if ((volts_fp = read_raw_battery_level()) < 0) {
-		return volts_fp;
+	// Get filtered level from last sample
+	if ((rc = input_battery_get(&reading))) {
+		return rc;
 	}
 
-	// Calculate voltage in fixed point
-	volts_fp *= 330 * 21;
-	volts_fp /= 4095;
-
 	// Format into buffer
-	return sprintf(buf, "%d.%03d\n", volts_fp / 1000, volts_fp % 1000);
+	return sprintf(buf, "%d.%03d\n",
+		reading.voltage_mv / 1000, reading.voltage_mv % 1000);
 }
 struct kobj_attribute battery_volts_attr
 	= __ATTR(battery_volts, 0444, battery_volts_show, NULL);
 
-// Battery percent approximate
+// Battery percent from discharge curve
 static ssize_t battery_percent_show(struct kobject *kobj, struct kobj_attribute *attr,
 	char *buf)
 {
-	int percent;
-
-	// Read raw level
-	if ((percent = read_raw_battery_level()) < 0) {
-		return percent;
-	}
-
-	// Calculate voltage in fixed point
-	percent *= 330 * 21;
-	percent /= 4095;
-
-	// Range from 3.2V min to 4.2V max
-	// `percent` currently contains the fp voltage value (v * 1000; e.g. in the range from 3200 to 4200)
-	// To convert to a percentage in the range from 0 - 1 we subtract the value at 0% (3200)
-	// and divide by the difference between lowest value and higest value (4200 - 3200). Then
-	// multiply by 100 to get 0 - 100. This can all be simplified to:
-	percent -= 3200;
-	percent /= 10;
+	int rc;
+	struct battery_reading reading;
 
-	// If the voltage goes above 4.2v the percentage will go above 100. This can happen while plugged in.
-	if (percent > 100) {
-		percent = 100;
-	// If the voltage drops below 3.2v the percentage will go below 0, so cap at 0.
-	} else if (percent < 0) {
-		percent = 0;
+	// Get filtered level from last sample
+	if ((rc = input_battery_get(&reading))) {
+		return rc;
 	}
 
 	// Format into buffer
-	return sprintf(buf, "%d\n", percent);
+	return sprintf(buf, "%d\n", reading.capacity);
 }
 struct kobj_attribute battery_percent_attr
 	= __ATTR(battery_percent, 0444, battery_percent_show, NULL);
@@ -137,7 +118,7 @@ struct kobj_attribute battery_percent_attr
 static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr,
 	char const *buf, size_t count)
 {
-	return parse_and_write_i2c_u8(buf, count, REG_LED);
+	return parse_and_write_led_reg(buf, count, REG_LED);
 }
 struct kobj_attribute led_attr = __ATTR(led, 0220, NULL, led_store);
 
@@ -145,7 +126,7 @@ struct kobj_attribute led_attr = __ATTR(led, 0220, NULL, led_store);
 static ssize_t led_red_store(struct kobject *kobj, struct kobj_attribute *attr,
 	char const *buf, size_t count)
 {
-	return parse_and_write_i2c_u8(buf, count, REG_LED_R);
+	return parse_and_write_led_reg(buf, count, REG_LED_R);
 }
 struct kobj_attribute led_red_attr = __ATTR(led_red, 0220, NULL, led_red_store);
 
@@ -153,7 +134,7 @@ struct kobj_attribute led_red_attr = __ATTR(led_red, 0220, NULL, led_red_store);
 static ssize_t led_green_store(struct kobject *kobj, struct kobj_attribute *attr,
 	char const *buf, size_t count)
 {
-	return parse_and_write_i2c_u8(buf, count, REG_LED_G);
+	return parse_and_write_led_reg(buf, count, REG_LED_G);
 }
 struct kobj_attribute led_green_attr = __ATTR(led_green, 0220, NULL, led_green_store);
 
@@ -161,15 +142,68 @@ struct kobj_attribute led_green_attr = __ATTR(led_green, 0220, NULL, led_green_s
 static ssize_t __used led_blue_store(struct kobject *kobj, struct kobj_attribute *attr,
 	char const *buf, size_t count)
 {
-	return parse_and_write_i2c_u8(buf, count, REG_LED_B);
+	return parse_and_write_led_reg(buf, count, REG_LED_B);
 }
 struct kobj_attribute led_blue_attr = __ATTR(led_blue, 0220, NULL, led_blue_store);
 
+// LED color and mode, set together
+static ssize_t led_rgb_show(struct kobject *kobj, struct kobj_attribute *attr,
+	char *buf)
+{
+	struct kbd_led_rgb led;
+
+	input_leds_get(&led);
+
+	return sprintf(buf, "%u %u %u %u\n", led.r, led.g, led.b, led.mode);
+}
+static ssize_t led_rgb_store(struct kobject *kobj, struct kobj_attribute *attr,
+	char const *buf, size_t count)
+{
+	int rc;
+	unsigned int r, g, b, mode;
+	struct kbd_led_rgb led;
+
+	// Parse `r g b`, with optional mode
+	mode = REG_LED_MODE_ON;
+	rc = sscanf(buf, "%u %u %u %u", &r, &g, &b, &mode);
+	if ((rc < 3) || (r > 0xff) || (g > 0xff) || (b > 0xff)
+	 || (mode > REG_LED_MODE_FLASH_UNTIL_KEY)) {
+		return -EINVAL;
+	}
+
+	if (!g_ctx || !g_ctx->i2c_client) {
+		return -ENODEV;
+	}
+
+	led.mode = mode;
+	led.r = r;
+	led.g = g;
+	led.b = b;
+	if ((rc = input_leds_set(g_ctx, &led))) {
+		return rc;
+	}
+
+	return count;
+}
+struct kobj_attribute led_rgb_attr = __ATTR(led_rgb, 0660, led_rgb_show, led_rgb_store);
+
 // Keyboard backlight value
 static ssize_t __used keyboard_backlight_store(struct kobject *kobj,
 	struct kobj_attribute *attr, char const *buf, size_t count)
 {
-	return parse_and_write_i2c_u8(buf, count, REG_BKL);
+	int parsed;
+
+	// Parse string entry
+	if ((parsed = parse_u8(buf)) < 0) {
+		return -EINVAL;
+	}
+
+	// Set brightness, restored to this level after idle dimming
+	if (g_ctx && g_ctx->i2c_client) {
+		input_fw_set_brightness(g_ctx, (uint8_t)parsed);
+	}
+
+	return count;
 }
 struct kobj_attribute keyboard_backlight_attr
 	= __ATTR(keyboard_backlight, 0220, NULL, keyboard_backlight_store);
@@ -205,6 +239,19 @@ static ssize_t fw_version_show(struct kobject *kobj, struct kobj_attribute *attr
 struct kobj_attribute fw_version_attr
 	= __ATTR(fw_version, 0444, fw_version_show, NULL);
 
+static char const* startup_reason_name(uint8_t reason)
+{
+	switch (reason) {
+
+		case STARTUP_REASON_FW_INIT: return "fw_init";
+		case STARTUP_REASON_BUTTON: return "power_button";
+		case STARTUP_REASON_REWAKE: return "rewake";
+		case STARTUP_REASON_REWAKE_CANCELED: return "rewake_canceled";
+	}
+
+	return NULL;
+}
+
 // Why the Pi was powered on
 static ssize_t startup_reason_show(struct kobject *kobj, struct kobj_attribute *attr,
 	char *buf)
@@ -222,12 +269,8 @@ static ssize_t startup_reason_show(struct kobject *kobj, struct kobj_attribute *
 		return rc;
 	}
 
-	switch (reason) {
-
-		case STARTUP_REASON_FW_INIT: return sprintf(buf, "fw_init\n");
-		case STARTUP_REASON_BUTTON: return sprintf(buf, "power_button\n");
-		case STARTUP_REASON_REWAKE: return sprintf(buf, "rewake\n");
-		case STARTUP_REASON_REWAKE_CANCELED: return sprintf(buf, "rewake_canceled\n");
+	if (startup_reason_name(reason)) {
+		return sprintf(buf, "%s\n", startup_reason_name(reason));
 	}
 
 	return sprintf(buf, "unknown: %d\n", reason);
@@ -236,80 +279,186 @@ struct kobj_attribute startup_reason_attr
 	= __ATTR(startup_reason, 0444, startup_reason_show, NULL);
 
 // Firmware update
+// Returns after data is written to firmware
 static ssize_t __used fw_update_store(struct kobject *kobj,
 	struct kobj_attribute *attr, char const *buf, size_t count)
+{
+	if (!g_ctx || !g_ctx->i2c_client) {
+		return -ENODEV;
+	}
+
+	return input_fw_update_write(g_ctx, buf, count);
+}
+struct kobj_attribute fw_update_attr
+	= __ATTR(fw_update, 0220, NULL, fw_update_store);
+
+// Firmware update from image in firmware search path
+static ssize_t __used fw_update_file_store(struct kobject *kobj,
+	struct kobj_attribute *attr, char const *buf, size_t count)
 {
 	int rc;
-	size_t i;
-	uint8_t update_state;
-	char const* update_error = NULL;
 
-	// Write value to update
-	if (g_ctx && g_ctx->i2c_client) {
+	if (!g_ctx || !g_ctx->i2c_client) {
+		return -ENODEV;
+	}
 
-		// Read update status
-		if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_UPDATE_DATA, &update_state)) < 0) {
-			return rc;
-		}
+	if ((rc = input_fw_update_request(g_ctx, buf))) {
+		return rc;
+	}
 
-		// Start a new update
-		if ((update_state == UPDATE_OFF) || (update_state >= UPDATE_FAILED)) {
-			dev_info(&g_ctx->i2c_client->dev,
-				"fw_update: starting new update, writing %zu bytes\n", count);
+	return count;
+}
+struct kobj_attribute fw_update_file_attr
+	= __ATTR(fw_update_file, 0220, NULL, fw_update_file_store);
 
-		// In-progress update
-		} else if (update_state == UPDATE_RECV) {
-			dev_info(&g_ctx->i2c_client->dev,
-				"fw_update: writing %zu bytes\n", count);
-		}
+// Firmware update progress
+static ssize_t fw_update_status_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct fw_update_progress progress;
+	uint64_t elapsed_ms, bytes_per_sec, eta_secs;
+	char const* state;
+
+	input_fw_update_get_progress(&progress);
+
+	// Describe update state
+	if (progress.error) {
+		state = "i2c_error";
+	} else if (progress.state >= UPDATE_FAILED) {
+		state = input_fw_update_error(progress.state);
+	} else if (progress.running || (progress.state == UPDATE_RECV)) {
+		state = "receiving";
+	} else if (progress.bytes_written) {
+		state = "completed";
+	} else {
+		state = "idle";
+	}
 
-		for (i = 0; i < count; i++) {
-			kbd_write_i2c_u8(g_ctx->i2c_client, REG_UPDATE_DATA, (uint8_t)buf[i]);
-		}
+	// Throughput and estimated time remaining
+	elapsed_ms = div_u64(ktime_get_boottime_ns() - progress.started_at,
+		NSEC_PER_MSEC);
+	bytes_per_sec = (elapsed_ms && progress.bytes_written)
+		? div64_u64((uint64_t)progress.bytes_written * MSEC_PER_SEC, elapsed_ms)
+		: 0;
+	eta_secs = (bytes_per_sec && (progress.bytes_total > progress.bytes_written))
+		? div64_u64(progress.bytes_total - progress.bytes_written, bytes_per_sec)
+		: 0;
+
+	return sprintf(buf,
+		"state: %s\n"
+		"bytes_written: %zu\n"
+		"bytes_total: %zu\n"
+		"bytes_per_sec: %llu\n"
+		"eta_secs: %llu\n",
+		state, progress.bytes_written, progress.bytes_total,
+		bytes_per_sec, eta_secs);
+}
+struct kobj_attribute fw_update_status_attr
+	= __ATTR(fw_update_status, 0444, fw_update_status_show, NULL);
 
-		// Read update status
-		if ((rc = kbd_read_i2c_u8(g_ctx->i2c_client, REG_UPDATE_DATA, &update_state)) < 0) {
-			return rc;
-		}
+// Print names of modifiers set in `mods`
+static int sprint_modifiers(char *buf, uint8_t mods)
+{
+	static const struct {
+		uint8_t bit;
+		char const* name;
+	} modifier_names[] = {
+		{ MODIFIER_SHIFT, "shift" },
+		{ MODIFIER_CTRL, "ctrl" },
+		{ MODIFIER_PHYS_ALT, "phys_alt" },
+		{ MODIFIER_ALT, "alt" },
+		{ MODIFIER_SYM, "sym" },
+	};
+	int i, len;
+
+	if (!mods) {
+		return sprintf(buf, "none");
+	}
 
-		// Successful update
-		if (update_state == UPDATE_OFF) {
-			dev_info(&g_ctx->i2c_client->dev,
-				"fw_update: wrote %zu bytes, update completed\n", count);
-
-		// Update still in-progress
-		} else if (update_state == UPDATE_RECV) {
-			dev_info(&g_ctx->i2c_client->dev,
-				"fw_update: wrote %zu bytes\n", count);
-
-		// Update failed
-		} else if (update_state >= UPDATE_FAILED) {
-
-			update_error = "update failed";
-
-			switch (update_state) {
-			case UPDATE_FAILED_LINE_OVERFLOW:
-				update_error = "hex line too long"; break;
-			case UPDATE_FAILED_FLASH_EMPTY:
-				update_error = "flash image empty"; break;
-			case UPDATE_FAILED_FLASH_OVERFLOW:
-				update_error = "flash image > 64k"; break;
-			case UPDATE_FAILED_BAD_LINE:
-				update_error = "could not parse hex line"; break;
-			case UPDATE_FAILED_BAD_CHECKSUM:
-				update_error = "bad checksum"; break;
-			}
-
-			dev_info(&g_ctx->i2c_client->dev,
-				"fw_update: failed: %s\n", update_error);
-			return -EINVAL;
+	len = 0;
+	for (i = 0; i < ARRAY_SIZE(modifier_names); i++) {
+		if (mods & modifier_names[i].bit) {
+			len += sprintf(buf + len, "%s%s",
+				(len) ? "," : "", modifier_names[i].name);
 		}
 	}
 
-	return count;
+	return len;
 }
-struct kobj_attribute fw_update_attr
-	= __ATTR(fw_update, 0220, NULL, fw_update_store);
+
+// Driver and firmware state in a single read
+// Everything but the startup reason is served from driver state
+static ssize_t telemetry_show(struct kobject *kobj, struct kobj_attribute *attr,
+	char *buf)
+{
+	int len;
+	uint8_t reason, backlight, mods_active, mods_locked;
+	int64_t last_keypress_ms;
+	struct battery_reading battery;
+	struct kbd_led_rgb led;
+	char const* reason_name;
+
+	// Make sure I2C client was initialized
+	if ((g_ctx == NULL) || (g_ctx->i2c_client == NULL)) {
+		return -EINVAL;
+	}
+
+	// Startup reason changes when rewake polling is canceled
+	reason_name = (kbd_read_i2c_u8(g_ctx->i2c_client, REG_STARTUP_REASON, &reason))
+		? NULL
+		: startup_reason_name(reason);
+
+	// Backlight register is held in the register cache
+	if (kbd_read_i2c_u8(g_ctx->i2c_client, REG_BKL, &backlight)) {
+		backlight = 0;
+	}
+
+	if (input_battery_get(&battery)) {
+		memset(&battery, 0, sizeof(battery));
+	}
+	input_leds_get(&led);
+	input_modifiers_get_state(&mods_active, &mods_locked);
+
+	last_keypress_ms = (g_ctx->last_keypress_at < ktime_get_boottime_ns())
+		? div_u64(ktime_get_boottime_ns() - g_ctx->last_keypress_at, NSEC_PER_MSEC)
+		: -1;
+
+	len = sprintf(buf,
+		"telemetry_version: %d\n"
+		"fw_version: %d.%d\n"
+		"startup_reason: %s\n"
+		"battery_raw: %d\n"
+		"battery_mv: %d\n"
+		"battery_percent: %d\n"
+		"led: %u %u %u %u\n"
+		"keyboard_backlight: %u\n"
+		"touch_enabled: %u\n"
+		"touch_act: %s\n"
+		"touch_as: %s\n"
+		"meta_mode: %u\n"
+		"last_keypress: %lld\n",
+		BBQX0KBD_TELEMETRY_VERSION,
+		g_ctx->version_number >> 4, g_ctx->version_number & 0xf,
+		(reason_name) ? reason_name : "unknown",
+		battery.raw, battery.voltage_mv, battery.capacity,
+		led.r, led.g, led.b, led.mode,
+		backlight,
+		g_ctx->touch.enabled,
+		(g_ctx->touch.activation == TOUCH_ACT_CLICK) ? "click" : "always",
+		(g_ctx->touch.input_as == TOUCH_INPUT_AS_MOUSE) ? "mouse" : "keys",
+		input_meta_is_enabled(),
+		last_keypress_ms);
+
+	len += sprintf(buf + len, "modifiers: ");
+	len += sprint_modifiers(buf + len, mods_active);
+	len += sprintf(buf + len, "\nmodifiers_locked: ");
+	len += sprint_modifiers(buf + len, mods_locked);
+	len += sprintf(buf + len, "\n");
+
+	return len;
+}
+struct kobj_attribute telemetry_attr
+	= __ATTR(telemetry, 0444, telemetry_show, NULL);
 
 // Time since last keypress in milliseconds
 static ssize_t last_keypress_show(struct kobject *kobj, struct kobj_attribute *attr,
@@ -337,8 +486,81 @@ static ssize_t last_keypress_show(struct kobject *kobj, struct kobj_attribute *a
 struct kobj_attribute last_keypress_attr
 	= __ATTR(last_keypress, 0444, last_keypress_show, NULL);
 
-// Sysfs attributes (entries)
+// Change notifications
+
+// Notifies pollers of a sysfs entry at most once per notification period
+struct attr_notifier
+{
+	char const* attr_name;
+	struct delayed_work work;
+	unsigned long last_at;
+};
+
+static unsigned int g_notify_ms = BBQX0KBD_NOTIFY_PERIOD;
+
+// Notifications are only queued while ready, protected by notify lock,
+// so that no work is queued after shutdown cancels it
+static DEFINE_SPINLOCK(g_notify_lock);
+static uint8_t g_notify_ready;
+static struct attr_notifier g_last_keypress_notifier;
+static struct attr_notifier g_battery_notifier;
+
 struct kobject *beepy_kobj = NULL;
+
+static void notify_work_handler(struct work_struct* work)
+{
+	struct attr_notifier *notifier;
+
+	notifier = container_of(to_delayed_work(work), struct attr_notifier, work);
+
+	if (beepy_kobj) {
+		sysfs_notify(beepy_kobj, NULL, notifier->attr_name);
+	}
+	notifier->last_at = jiffies;
+}
+
+static void init_notifier(struct attr_notifier* notifier, char const* attr_name)
+{
+	notifier->attr_name = attr_name;
+	notifier->last_at = jiffies - msecs_to_jiffies(g_notify_ms);
+	INIT_DELAYED_WORK(&notifier->work, notify_work_handler);
+}
+
+// Notify now, or at the end of the current notification period.
+// Notifications within one period are coalesced into a single wakeup
+static void notify_attr(struct attr_notifier* notifier)
+{
+	unsigned long next_at, flags;
+
+	spin_lock_irqsave(&g_notify_lock, flags);
+
+	if (g_notify_ready) {
+		next_at = notifier->last_at + msecs_to_jiffies(g_notify_ms);
+		queue_delayed_work(system_freezable_power_efficient_wq, &notifier->work,
+			time_after_eq(jiffies, next_at) ? 0 : next_at - jiffies);
+	}
+
+	spin_unlock_irqrestore(&g_notify_lock, flags);
+}
+
+void sysfs_set_notify_ms(unsigned int notify_ms)
+{
+	g_notify_ms = notify_ms;
+}
+
+// First keypress after idle, and entering idle
+void sysfs_notify_last_keypress(void)
+{
+	notify_attr(&g_last_keypress_notifier);
+}
+
+// Battery percentage moved to another band
+void sysfs_notify_battery(void)
+{
+	notify_attr(&g_battery_notifier);
+}
+
+// Sysfs attributes (entries)
 static struct attribute *beepy_attrs[] = {
 	&battery_raw_attr.attr,
 	&battery_volts_attr.attr,
@@ -347,12 +569,16 @@ static struct attribute *beepy_attrs[] = {
 	&led_red_attr.attr,
 	&led_green_attr.attr,
 	&led_blue_attr.attr,
+	&led_rgb_attr.attr,
 	&keyboard_backlight_attr.attr,
 	&rewake_timer_attr.attr,
 	&startup_reason_attr.attr,
 	&fw_version_attr.attr,
 	&fw_update_attr.attr,
+	&fw_update_file_attr.attr,
+	&fw_update_status_attr.attr,
 	&last_keypress_attr.attr,
+	&telemetry_attr.attr,
 	NULL,
 };
 static struct attribute_group beepy_attr_group = {
@@ -405,11 +631,31 @@ int sysfs_probe(struct i2c_client* i2c_client)
 		return -ENOMEM;
 	}
 
+	// Start sending change notifications
+	init_notifier(&g_last_keypress_notifier, "last_keypress");
+	init_notifier(&g_battery_notifier, "battery_percent");
+	spin_lock_irq(&g_notify_lock);
+	g_notify_ready = 1;
+	spin_unlock_irq(&g_notify_lock);
+
 	return 0;
 }
 
 void sysfs_shutdown(struct i2c_client* i2c_client)
 {
+	uint8_t notify_ready;
+
+	// Stop change notifications. Idle and battery work still running
+	// see that notifications are stopped and do not queue them again
+	spin_lock_irq(&g_notify_lock);
+	notify_ready = g_notify_ready;
+	g_notify_ready = 0;
+	spin_unlock_irq(&g_notify_lock);
+	if (notify_ready) {
+		cancel_delayed_work_sync(&g_last_keypress_notifier.work);
+		cancel_delayed_work_sync(&g_battery_notifier.work);
+	}
+
 	// Remove sysfs entry
 	if (beepy_kobj) {
 		kobject_put(beepy_kobj);
@@ -9,4 +9,8 @@
 int sysfs_probe(struct i2c_client* i2c_client);
 void sysfs_shutdown(struct i2c_client* i2c_client);
 
+void sysfs_set_notify_ms(unsigned int notify_ms);
+void sysfs_notify_last_keypress(void);
+void sysfs_notify_battery(void);
+
 #endif